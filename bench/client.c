@@ -0,0 +1,100 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// latency and throughput of a server started with ./main --serve.
+//
+//   bench/client [-n requests] [-p depth] socket expr
+//
+// sends expr as n requests over one connection, with up to depth of
+// them in flight at a time, and prints the first response, requests
+// per second and the median and 99th percentile latency
+
+double now_us() {
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1e6 + t.tv_nsec / 1e3;
+}
+
+int cmp_double(const void *a, const void *b) {
+   double x = *(const double *)a, y = *(const double *)b;
+   return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+   int n = 1000;
+   int depth = 1;
+   int opt;
+   while ((opt = getopt(argc, argv, "n:p:")) != -1) {
+      switch (opt) {
+         case 'n': n = atoi(optarg); break;
+         case 'p': depth = atoi(optarg); break;
+         default: return 2;
+      }
+   }
+   if (argc - optind != 2 || n < 1 || depth < 1) {
+      fprintf(stderr, "usage: %s [-n requests] [-p depth] socket expr\n",
+         argv[0]);
+      return 2;
+   }
+
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+      perror(argv[optind]);
+      return 1;
+   }
+
+   // a newline ends a request that is a bare atom
+   size_t len = strlen(argv[optind + 1]);
+   char *req = malloc(len + 2);
+   memcpy(req, argv[optind + 1], len);
+   req[len++] = '\n';
+
+   double *sent = malloc(sizeof(double) * n);
+   double *lat = malloc(sizeof(double) * n);
+   char first[256];
+   size_t first_len = 0;
+   int nsent = 0, nrecv = 0;
+   double start = now_us();
+
+   while (nrecv < n) {
+      while (nsent < n && nsent - nrecv < depth) {
+         if (write(fd, req, len) != (ssize_t)len) {
+            perror("write");
+            return 1;
+         }
+         sent[nsent++] = now_us();
+      }
+
+      char buf[4096];
+      ssize_t got = read(fd, buf, sizeof(buf));
+      if (got <= 0) {
+         fprintf(stderr, "server closed the connection\n");
+         return 1;
+      }
+      for (ssize_t i = 0; i < got; i++) {
+         if (buf[i] == '\0')
+            lat[nrecv] = now_us() - sent[nrecv], nrecv++;
+         else if (nrecv == 0 && first_len < sizeof(first) - 1)
+            first[first_len++] = buf[i];
+      }
+   }
+
+   double total = now_us() - start;
+   first[first_len] = '\0';
+   qsort(lat, n, sizeof(double), cmp_double);
+   printf("response: %s", first);
+   printf("%d requests, depth %d: %.0f requests/s, "
+      "latency p50 %.0f us, p99 %.0f us\n",
+      n, depth, n / total * 1e6, lat[n / 2], lat[n * 99 / 100]);
+
+   close(fd);
+   return 0;
+}
@@ -0,0 +1,97 @@
+#!/bin/sh
+# Runs every workload in bench/ and reports wall time, allocations and
+# peak resident memory for each.
+#
+#   bench/run.sh [-n runs] [binary]
+#   bench/run.sh [-n runs] [-t percent] -c base_binary [binary]
+#
+# A binary may come with options, as in -c ./main "./main --jit".
+# With -c the workloads run under both binaries and any workload that
+# got slower by more than -t percent (default 5), allocates more or
+# prints something different is flagged. The exit status is 1 if
+# anything was flagged.
+
+runs=3
+threshold=5
+base=
+while getopts n:t:c: opt; do
+   case $opt in
+      n) runs=$OPTARG ;;
+      t) threshold=$OPTARG ;;
+      c) base=$OPTARG ;;
+      *) exit 2 ;;
+   esac
+done
+shift $((OPTIND - 1))
+bin=${1:-./main}
+
+cd "$(dirname "$0")/.." || exit 2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# the parse workload reads a generated file
+mkdir -p bench/gen
+if [ ! -f bench/gen/large.lspy ]; then
+   awk 'BEGIN {
+      for (i = 0; i < 800; i++)
+         printf "(fun {f%d x y} {if (> x y) {+ x (* y %d)} {- y \"s\" {1 2 3}}})\n", i, i
+   }' > bench/gen/large.lspy
+fi
+
+# run workload $2 under binary $1 $runs times, print the fastest wall
+# time in ms followed by allocations and peak resident KB
+measure() {
+   best=
+   i=0
+   while [ $i -lt "$runs" ]; do
+      start=$(date +%s%N)
+      $1 --stats "$2" > "$tmp/out" 2> "$tmp/err"
+      end=$(date +%s%N)
+      ms=$(( (end - start) / 1000000 ))
+      if [ -z "$best" ] || [ $ms -lt "$best" ]; then
+         best=$ms
+      fi
+      i=$((i + 1))
+   done
+   allocs=$(sed -n 's/^heap: \([0-9]*\) allocations.*/\1/p' "$tmp/err")
+   rss=$(sed -n 's/^heap: \([0-9]*\) KB peak resident/\1/p' "$tmp/err")
+   echo "$best ${allocs:-0} ${rss:-0}"
+}
+
+status=0
+if [ -z "$base" ]; then
+   printf "%-10s %10s %12s %10s\n" workload "time ms" allocs "peak KB"
+else
+   printf "%-10s %10s %10s %8s %8s %s\n" \
+      workload "base ms" "new ms" time allocs ""
+fi
+
+for w in bench/*.lspy; do
+   name=$(basename "$w" .lspy)
+   set -- $(measure "$bin" "$w")
+   cp "$tmp/out" "$tmp/new.out"
+   if [ -z "$base" ]; then
+      printf "%-10s %10s %12s %10s\n" "$name" "$1" "$2" "$3"
+      continue
+   fi
+
+   new_ms=$1 new_allocs=$2
+   set -- $(measure "$base" "$w")
+   base_ms=$1 base_allocs=$2
+
+   flag=
+   if ! cmp -s "$tmp/out" "$tmp/new.out"; then
+      flag="OUTPUT DIFFERS"
+   elif [ $((new_ms * 100)) -gt $((base_ms * (100 + threshold))) ]; then
+      flag="SLOWER"
+   elif [ "$new_allocs" -gt "$base_allocs" ]; then
+      flag="MORE ALLOCATIONS"
+   fi
+   [ -n "$flag" ] && status=1
+
+   printf "%-10s %10s %10s %8s %8s %s\n" "$name" "$base_ms" "$new_ms" \
+      "$(awk "BEGIN { printf \"%.2fx\", $base_ms / ($new_ms ? $new_ms : 1) }")" \
+      "$(awk "BEGIN { printf \"%.2fx\", $base_allocs / ($new_allocs ? $new_allocs : 1) }")" \
+      "$flag"
+done
+exit $status
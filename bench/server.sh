@@ -0,0 +1,47 @@
+#!/bin/sh
+# Latency and throughput of a warm server started with --serve, against
+# starting a process for every request.
+#
+#   bench/server.sh [-n requests] [binary]
+#
+# The server loads the prelude once, bench/client then sends the same
+# small expression over one connection, one request at a time and with
+# 16 in flight.
+
+requests=2000
+while getopts n: opt; do
+   case $opt in
+      n) requests=$OPTARG ;;
+      *) exit 2 ;;
+   esac
+done
+shift $((OPTIND - 1))
+bin=${1:-./main}
+
+cd "$(dirname "$0")/.." || exit 2
+tmp=$(mktemp -d)
+trap 'kill $server 2> /dev/null; rm -rf "$tmp"' EXIT
+
+make -s bench/client || exit 2
+expr='(foldl + 0 {1 2 3})'
+
+$bin --serve "$tmp/sock" prelude.lspy > /dev/null &
+server=$!
+while [ ! -S "$tmp/sock" ]; do
+   sleep 0.1
+done
+bench/client -n "$requests" "$tmp/sock" "$expr" || exit 1
+bench/client -n "$requests" -p 16 "$tmp/sock" "$expr" | tail -n 1
+
+# a tenth of the requests is enough to time a process per request
+echo "$expr" > "$tmp/req.lspy"
+n=$((requests / 10))
+start=$(date +%s%N)
+i=0
+while [ $i -lt $n ]; do
+   $bin prelude.lspy "$tmp/req.lspy" > /dev/null
+   i=$((i + 1))
+done
+end=$(date +%s%N)
+us=$(( (end - start) / 1000 / n ))
+echo "$n processes: $((1000000 / (us ? us : 1))) requests/s, latency $us us"
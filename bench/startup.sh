@@ -0,0 +1,55 @@
+#!/bin/sh
+# Time to run a short script in a fresh process started from an image
+# written with --save-image, against one that loads the prelude from
+# source first.
+#
+#   bench/startup.sh [-n runs] [binary]
+#
+# Each way starts the binary -n times (default 200) and reports the
+# mean wall time of a run. The script must print the same either way.
+
+runs=200
+while getopts n: opt; do
+   case $opt in
+      n) runs=$OPTARG ;;
+      *) exit 2 ;;
+   esac
+done
+shift $((OPTIND - 1))
+bin=${1:-./main}
+
+cd "$(dirname "$0")/.." || exit 2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+echo '(print (foldl + 0 (collect (map (\ {x} {* x x}) (range 10)))))' \
+   > "$tmp/script.lspy"
+$bin --save-image "$tmp/prelude.img" prelude.lspy > /dev/null || exit 1
+
+# start $bin $runs times with options $1, print the mean time in us
+measure() {
+   start=$(date +%s%N)
+   i=0
+   while [ $i -lt "$runs" ]; do
+      $bin $1 "$tmp/script.lspy" > "$tmp/out"
+      i=$((i + 1))
+   done
+   end=$(date +%s%N)
+   echo $(( (end - start) / 1000 / runs ))
+}
+
+# loading the prelude from source also prints ok for each of its forms
+source_us=$(measure prelude.lspy)
+grep -v '^ok$' "$tmp/out" > "$tmp/source.out"
+image_us=$(measure "--image $tmp/prelude.img")
+grep -v '^ok$' "$tmp/out" > "$tmp/image.out"
+if ! cmp -s "$tmp/image.out" "$tmp/source.out" || [ ! -s "$tmp/image.out" ]; then
+   echo "output differs between the image and the source" >&2
+   exit 1
+fi
+
+printf "%-8s %10s\n" start "us/run"
+printf "%-8s %10s\n" source "$source_us"
+printf "%-8s %10s %6s.%02dx\n" image "$image_us" \
+   $((source_us / (image_us ? image_us : 1))) \
+   $((source_us * 100 / (image_us ? image_us : 1) % 100))
@@ -0,0 +1,401 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// random program generator for the differential harness in run.sh.
+//
+//   fuzz/gen seed forms
+//
+// prints a program of the given number of top level forms. programs
+// cover arithmetic, comparisons, list builtins, lambdas, currying,
+// '&' varargs, lazy sequences, loops, errors and rebinding of builtins
+// and constants. functions only call functions defined before them, so
+// every program terminates
+
+#define MAX_FUNS 32
+#define MAX_VARS 32
+#define MAX_DEPTH 4
+
+// a user function and the number of fixed formals it takes
+struct {
+   char name[16];
+   int arity;
+   bool variadic;
+} funs[MAX_FUNS];
+int nfuns;
+
+// global variables holding numbers and lists
+char nums[MAX_VARS][16];
+int nnums;
+char lists[MAX_VARS][16];
+int nlists;
+
+// formals in scope in the lambda body being generated
+char *scope[8];
+int nscope;
+
+unsigned long seed;
+
+int rnd(int n) {
+   // xorshift, the same on every platform
+   seed ^= seed << 13;
+   seed ^= seed >> 7;
+   seed ^= seed << 17;
+   return (int)(seed % (unsigned long)n);
+}
+
+bool chance(int percent) {
+   return rnd(100) < percent;
+}
+
+void gen_num(int d);
+void gen_list(int d);
+void gen_fun(int d, int arity);
+
+void gen_literal() {
+   switch (rnd(8)) {
+      case 0: printf("0"); break;
+      case 1: printf("-%d", rnd(10)); break;
+      case 2: printf("%d.5", rnd(5)); break;
+      default: printf("%d", rnd(20)); break;
+   }
+}
+
+void gen_args(int d, int n) {
+   for (int i = 0; i < n; i++) {
+      putchar(' ');
+      gen_num(d);
+   }
+}
+
+// call a user function with about the right number of arguments,
+// sometimes too few or too many
+void gen_call(int d) {
+   int f = rnd(nfuns);
+   int n = funs[f].arity;
+   if (chance(10))
+      n += rnd(3) - 1;
+   if (n < 0)
+      n = 0;
+   if (funs[f].variadic)
+      n += rnd(3);
+
+   // curry the first argument separately now and then
+   if (n > 1 && chance(30)) {
+      printf("((%s", funs[f].name);
+      gen_args(d, 1);
+      printf(")");
+      gen_args(d, n - 1);
+      printf(")");
+   } else if (n == 0) {
+      // a call with no arguments evaluates to the function itself
+      printf("(eval (list %s))", funs[f].name);
+   } else {
+      printf("(%s", funs[f].name);
+      gen_args(d, n);
+      printf(")");
+   }
+}
+
+void gen_cond(int d) {
+   static char *cmps[] = { "==", "!=", "<", ">", "<=", ">=" };
+   switch (rnd(4)) {
+      case 0:
+         printf("(! ");
+         gen_num(d);
+         printf(")");
+         break;
+      case 1:
+         printf("(%s", chance(50) ? "||" : "&&");
+         gen_args(d, 2);
+         printf(")");
+         break;
+      case 2:
+         printf("(== ");
+         gen_list(d);
+         putchar(' ');
+         gen_list(d);
+         printf(")");
+         break;
+      default:
+         printf("(%s", cmps[rnd(6)]);
+         gen_args(d, 2);
+         printf(")");
+         break;
+   }
+}
+
+void gen_num(int d) {
+   static char *ops[] = { "+", "-", "*", "/", "%" };
+   static char *consts[] = { "pi", "e", "true", "false" };
+
+   if (d >= MAX_DEPTH || chance(25)) {
+      int r = rnd(10);
+      if (r < 3 && nscope)
+         printf("%s", scope[rnd(nscope)]);
+      else if (r == 3)
+         printf("%s", consts[rnd(4)]);
+      else if (r == 4 && nnums)
+         printf("%s", nums[rnd(nnums)]);
+      else
+         gen_literal();
+      return;
+   }
+
+   switch (rnd(11)) {
+      case 0: case 1: case 2:
+         printf("(%s", ops[rnd(5)]);
+         gen_args(d + 1, 1 + rnd(3));
+         printf(")");
+         break;
+      case 3:
+         printf("(^ ");
+         gen_num(d + 1);
+         printf(" %d)", rnd(4));
+         break;
+      case 4:
+         printf("(if ");
+         gen_cond(d + 1);
+         printf(" {");
+         gen_num(d + 1);
+         printf("} {");
+         gen_num(d + 1);
+         printf("})");
+         break;
+      case 5:
+         if (nfuns) {
+            gen_call(d + 1);
+            break;
+         }
+         // fall through
+      case 6:
+         printf("(eval (head ");
+         gen_list(d + 1);
+         printf("))");
+         break;
+      case 7:
+         printf("(eval (len ");
+         gen_list(d + 1);
+         printf("))");
+         break;
+      case 8:
+         printf("(reduce ");
+         gen_fun(d + 1, 2);
+         putchar(' ');
+         gen_num(d + 1);
+         putchar(' ');
+         gen_list(d + 1);
+         printf(")");
+         break;
+      case 9: {
+         // a few rounds of a loop, its body sees the counter
+         bool bound = false;
+         for (int i = 0; i < nscope; i++)
+            bound = bound || strcmp(scope[i], "i") == 0;
+         printf("(loop {i} %d {if (< i %d) {recur (+ i 1)} {",
+            rnd(3), rnd(6));
+         if (!bound)
+            scope[nscope++] = "i";
+         gen_num(d + 1);
+         if (!bound)
+            nscope--;
+         printf("}})");
+         break;
+      }
+      default:
+         gen_cond(d + 1);
+         break;
+   }
+}
+
+void gen_list(int d) {
+   if (d >= MAX_DEPTH || chance(20)) {
+      if (nlists && chance(40)) {
+         printf("%s", lists[rnd(nlists)]);
+         return;
+      }
+      putchar('{');
+      int n = rnd(5);
+      for (int i = 0; i < n; i++) {
+         if (i)
+            putchar(' ');
+         gen_literal();
+      }
+      putchar('}');
+      return;
+   }
+
+   switch (rnd(9)) {
+      case 0:
+         printf("(list");
+         gen_args(d + 1, rnd(4));
+         printf(")");
+         break;
+      case 1:
+         printf("(%s ", chance(50) ? "tail" : "init");
+         gen_list(d + 1);
+         printf(")");
+         break;
+      case 2:
+         printf("(join ");
+         gen_list(d + 1);
+         putchar(' ');
+         gen_list(d + 1);
+         printf(")");
+         break;
+      case 3:
+         printf("(cons ");
+         gen_num(d + 1);
+         putchar(' ');
+         gen_list(d + 1);
+         printf(")");
+         break;
+      case 4:
+         printf("(head ");
+         gen_list(d + 1);
+         printf(")");
+         break;
+      case 5:
+         printf("(collect (map ");
+         gen_fun(d + 1, 1);
+         printf(" (range %d)))", rnd(6));
+         break;
+      case 6:
+         printf("(collect (filter ");
+         gen_fun(d + 1, 1);
+         putchar(' ');
+         gen_list(d + 1);
+         printf("))");
+         break;
+      case 7:
+         // an endless sequence, always cut short by take
+         printf("(collect (take %d (drop %d (iterate ", rnd(4), rnd(3));
+         gen_fun(d + 1, 1);
+         printf(" %d))))", rnd(5));
+         break;
+      default:
+         printf("(collect (take %d (drop %d (range %d %d %d))))",
+            rnd(5), rnd(3), rnd(5) - 2, 5 + rnd(10), 1 + rnd(3));
+         break;
+   }
+}
+
+// a function of the given arity, a builtin, a lambda or a partially
+// applied user function
+void gen_fun(int d, int arity) {
+   static char *ops[] = { "+", "-", "*", "max", "min" };
+   static char *formals[] = { "x", "y" };
+
+   int r = rnd(10);
+   if (r < 3) {
+      // max and min are not builtins, they come out as errors
+      printf("%s", ops[rnd(r == 0 ? 5 : 3)]);
+      return;
+   }
+
+   for (int i = 0; i < nfuns && r < 5; i++) {
+      int f = rnd(nfuns);
+      if (!funs[f].variadic && funs[f].arity == arity + 1) {
+         printf("(%s ", funs[f].name);
+         gen_num(d + 1);
+         printf(")");
+         return;
+      }
+   }
+
+   int saved = nscope;
+   printf("(\\ {");
+   for (int i = 0; i < arity; i++) {
+      printf(i ? " %s" : "%s", formals[i]);
+      scope[nscope++] = formals[i];
+   }
+   printf("} {");
+   gen_num(d + 1);
+   printf("})");
+   nscope = saved;
+}
+
+void gen_form() {
+   int r = rnd(20);
+
+   // define a function, now and then shadowing a constant or varargs
+   if (r < 5 && nfuns < MAX_FUNS) {
+      static char *names[] = { "a", "b", "c", "pi", "e" };
+      int f = nfuns;
+      snprintf(funs[f].name, sizeof(funs[f].name), "f%d", f);
+      funs[f].arity = rnd(4);
+      funs[f].variadic = chance(20);
+
+      printf("(fun {%s", funs[f].name);
+      nscope = 0;
+      for (int i = 0; i < funs[f].arity; i++) {
+         char *name = names[chance(10) ? 3 + rnd(2) : i];
+         bool taken = false;
+         for (int j = 0; j < nscope; j++)
+            taken = taken || strcmp(scope[j], name) == 0;
+         if (taken)
+            name = names[i];
+         printf(" %s", name);
+         scope[nscope++] = name;
+      }
+      if (funs[f].variadic)
+         printf(" & r");
+      printf("} {");
+      if (funs[f].variadic && chance(50)) {
+         printf("+ (eval (len (join {0} r))) ");
+         gen_num(1);
+      } else {
+         gen_num(0);
+      }
+      printf("})\n");
+      nscope = 0;
+      nfuns++;
+      return;
+   }
+
+   if (r < 8 && nnums < MAX_VARS) {
+      snprintf(nums[nnums], sizeof(nums[nnums]), "n%d", nnums);
+      printf("(def {%s} ", nums[nnums]);
+      gen_num(0);
+      printf(")\n");
+      nnums++;
+      return;
+   }
+
+   if (r < 10 && nlists < MAX_VARS) {
+      snprintf(lists[nlists], sizeof(lists[nlists]), "l%d", nlists);
+      printf("(def {%s} ", lists[nlists]);
+      gen_list(0);
+      printf(")\n");
+      nlists++;
+      return;
+   }
+
+   // rebind a constant, everything folded from it must follow
+   if (r == 10 && chance(30)) {
+      static char *consts[] = { "pi", "e", "true", "false" };
+      printf("(def {%s} ", consts[rnd(4)]);
+      gen_literal();
+      printf(")\n");
+      return;
+   }
+
+   if (r < 15)
+      gen_list(0);
+   else
+      gen_num(0);
+   putchar('\n');
+}
+
+int main(int argc, char *argv[]) {
+   if (argc != 3) {
+      fprintf(stderr, "usage: %s seed forms\n", argv[0]);
+      return 2;
+   }
+   seed = strtoul(argv[1], NULL, 10) * 2654435761ul + 1;
+   int forms = atoi(argv[2]);
+   for (int i = 0; i < forms; i++)
+      gen_form();
+   return 0;
+}
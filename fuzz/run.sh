@@ -0,0 +1,110 @@
+#!/bin/sh
+# Differential testing of the evaluation engines. Runs random programs
+# from fuzz/gen under the reference engine and every other engine,
+# reports programs whose printed results or errors differ and the
+# throughput of each engine.
+#
+#   fuzz/run.sh [-n programs] [-f forms] [-s seed] [-t percent]
+#               [-k rounds] [-r reference] [engine...]
+#
+# An engine is a command line that evaluates forms from stdin with
+# --batch, the reference defaults to "./main --reference" and the
+# engines to "./main". Programs an engine disagrees on are kept in
+# fuzz/failures/. An engine slower than the reference by more than -t
+# percent (default 5) is flagged. Each engine runs the programs -k times
+# (default 3) and the fastest round is reported, which keeps scheduling
+# noise out of the comparison. The exit status is 1 if anything
+# differed or was flagged.
+
+programs=200
+forms=40
+seed=1
+threshold=5
+rounds=3
+reference="./main --reference"
+while getopts n:f:s:t:k:r: opt; do
+   case $opt in
+      n) programs=$OPTARG ;;
+      f) forms=$OPTARG ;;
+      s) seed=$OPTARG ;;
+      t) threshold=$OPTARG ;;
+      k) rounds=$OPTARG ;;
+      r) reference=$OPTARG ;;
+      *) exit 2 ;;
+   esac
+done
+shift $((OPTIND - 1))
+[ $# -eq 0 ] && set -- ./main
+
+cd "$(dirname "$0")/.." || exit 2
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+make -s fuzz/gen || exit 2
+i=0
+while [ $i -lt "$programs" ]; do
+   fuzz/gen $((seed + i)) "$forms" > "$tmp/$i.lspy"
+   i=$((i + 1))
+done
+
+# run every program under engine $1 into $tmp/$2/, print the wall
+# time in ms of the fastest of the rounds
+run() {
+   mkdir -p "$tmp/$2"
+   best=
+   r=0
+   while [ $r -lt "$rounds" ]; do
+      total=0
+      i=0
+      while [ $i -lt "$programs" ]; do
+         start=$(date +%s%N)
+         timeout 10 $1 --batch < "$tmp/$i.lspy" > "$tmp/$2/$i.out" 2>&1
+         end=$(date +%s%N)
+         total=$((total + (end - start) / 1000))
+         i=$((i + 1))
+      done
+      [ -z "$best" ] || [ $total -lt "$best" ] && best=$total
+      r=$((r + 1))
+   done
+   echo $((best / 1000))
+}
+
+status=0
+ref_ms=$(run "$reference" ref)
+printf "%-28s %10s %12s %8s %s\n" engine "time ms" "forms/s" speed ""
+printf "%-28s %10s %12s %8s\n" "$reference" "$ref_ms" \
+   $((programs * forms * 1000 / (ref_ms ? ref_ms : 1))) "1.00x"
+
+n=0
+for engine in "$@"; do
+   n=$((n + 1))
+   ms=$(run "$engine" "e$n")
+
+   differ=0
+   i=0
+   while [ $i -lt "$programs" ]; do
+      if ! cmp -s "$tmp/ref/$i.out" "$tmp/e$n/$i.out"; then
+         differ=$((differ + 1))
+         mkdir -p fuzz/failures
+         cp "$tmp/$i.lspy" "fuzz/failures/$((seed + i)).lspy"
+      fi
+      i=$((i + 1))
+   done
+
+   flag=
+   if [ $differ -gt 0 ]; then
+      flag="$differ PROGRAMS DIFFER"
+   elif [ $((ms * 100)) -gt $((ref_ms * (100 + threshold))) ]; then
+      flag="SLOWER"
+   fi
+   [ -n "$flag" ] && status=1
+
+   printf "%-28s %10s %12s %8s %s\n" "$engine" "$ms" \
+      $((programs * forms * 1000 / (ms ? ms : 1))) \
+      "$(awk "BEGIN { printf \"%.2fx\", $ref_ms / ($ms ? $ms : 1) }")" \
+      "$flag"
+done
+
+[ $status -ne 0 ] && [ -d fuzz/failures ] &&
+   echo "programs that differ are in fuzz/failures/, named by seed"
+exit $status
@@ -1,22 +1,40 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 #include "external/mpc.h"
 #include <math.h>
-
-#define BUFFER_SIZE 2048
-
+#include <limits.h>
+#include <setjmp.h>
+#include <dlfcn.h>
+#include <ucontext.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <stdint.h>
+#include <dirent.h>
+
+// the error keeps args, so its message may refer to them
 #define LASSERT(args, cond, fmt, ...) \
    if (!(cond)) { \
-      lval *err = lval_err(fmt, ##__VA_ARGS__); \
-      lval_del(args); \
+      lval *err = lval_err_in(args, fmt, ##__VA_ARGS__); \
       return err; \
    }
 
 int max(int a, int b) { return a > b ? a : b; }
 
-static char input[BUFFER_SIZE];
-
 mpc_parser_t* Number;
 mpc_parser_t* Symbol;
 mpc_parser_t* String;
@@ -28,8 +46,20 @@ mpc_parser_t* Lispy;
 
 struct lval;
 struct lenv;
+struct lcells;
+struct lchunk;
+struct lseq;
+struct lchan;
+struct ltask;
+struct ljit;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcells lcells;
+typedef struct lchunk lchunk;
+typedef struct lseq lseq;
+typedef struct lchan lchan;
+typedef struct ltask ltask;
+typedef struct ljit ljit;
 
 // number types
 typedef enum {
@@ -40,25 +70,140 @@ typedef enum {
    LVAL_SEXPR,
    LVAL_QEXPR,
    LVAL_FUN,
+   LVAL_SEQ,
+   LVAL_CHAN,
 } NUMBER_TYPE;
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
+// most arguments an error message template takes
+#define LERR_ARGS 4
+
+typedef union {
+   long i;
+   double d;
+   char *s;
+} lerrarg;
+
+// an error, only errors carry one
+typedef struct {
+   char *text;      // message, formatted from fmt when first needed
+   char *fmt;       // static message template
+   lerrarg argv[LERR_ARGS];
+   lval *held;      // value the arguments point into
+} lerr;
+
 struct lval {
    int type;
+   int refs; // values are shared, mutate only when refs is 1
+   unsigned epoch;  // fold epoch v was last folded in, 0 if never
+   bool interned;   // in the hash-consing table, see lintern
+   lval *fold;      // value of the expression, computed ahead by lval_fold
+   unsigned long hash;  // of an interned value, equal values share it
+
+   // fields of the type of the value only
+   union {
+      struct {
+         double num;      // value of a number, nearest double if exact
+         long inum;       // value of an exact integer
+         bool exact;      // the number is an integer held in inum
+      };
+      lerr *err;
+      char *sym;
+      char *str;
+
+      struct {
+         lbuiltin builtin;
+         lenv *env;
+         lval *formals;
+         lval *body;
+         lval *partial;   // lambda a partial application calls
+         lval *args;      // arguments the partial application holds
+         ljit *jit;       // native code of a hot lambda, see ljit_call
+         int arity;       // lambda formals before '&', or all of them
+         int calls;       // calls of a lambda so far, until it is compiled
+         bool shadows;    // lambda formals rebind a builtin or a constant
+         bool variadic;   // lambda formals contain '&'
+      };
+
+      struct {
+         int count;
+         struct lval** cell;
+         lcells *store; // backing storage that cell points into
+      };
+
+      lseq *seq;
+      lchan *chan;
+   };
+};
 
-   double num;
-   char *err;
-   char *sym;
-   char *str;
+// list storage shared between every slice that references it,
+// a slot is NULL once its value has been moved out of the storage
+struct lcells {
+   int refs;
+   int count; // number of used slots
+   int cap;
+   lval **items;
+   lchunk *chunk; // chunk of the value stack holding it, NULL if none
+};
 
-   lbuiltin builtin;
-   lenv *env;
-   lval *formals;
-   lval *body;
+// slots of a chunk of the value stack, see lstack_push
+#define LSTACK_SLOTS 512
 
-   int count;
-   struct lval** cell;
+// slots an lcells takes on the value stack ahead of its items
+#define LCELLS_SLOTS \
+   (int)((sizeof(lcells) + sizeof(lval*) - 1) / sizeof(lval*))
+
+struct lchunk {
+   int refs;      // lists in it, plus one while it is the current chunk
+   int top;       // slots below top are taken
+   lchunk *next;  // next free chunk
+   lval *items[LSTACK_SLOTS];
+};
+
+// the value stack holds the argument lists of calls in progress. a
+// list takes the next slots of the current chunk and gives them back
+// when it is released, so a call allocates nothing for its arguments.
+// a list still held once its call returns, by 'list' or a rest
+// argument, keeps its slots. a chunk that fills up is retired and
+// lives on until the last list in it is released
+struct {
+   lchunk *cur;
+   lchunk *free;  // retired chunks no list is in anymore
+} lstack;
+
+// kinds of lazy sequence
+typedef enum {
+   LSEQ_RANGE,    // numbers from 'from' up to 'to' by 'step'
+   LSEQ_ITERATE,  // src, fn of src, fn of that and so on
+   LSEQ_LINES,    // lines of the file at path
+   LSEQ_MAP,
+   LSEQ_FILTER,
+   LSEQ_TAKE,     // first 'from' elements of src
+   LSEQ_DROP,     // src past its first 'from' elements
+} LSEQ_KIND;
+
+// a lazy sequence only describes its elements, an lcursor produces
+// them one at a time. it is never mutated, so copies share it
+struct lseq {
+   int refs;
+   int kind;
+   double from, to, step;
+   lval *fn;   // function of map, filter and iterate
+   lval *src;  // sequence or Q-Expression the elements come from
+   char *path;
+};
+
+// values sent on a channel queue up until they are received, tasks
+// that receive while it is empty wait on it in turn. see ltask
+struct lchan {
+   int refs;
+   lval **items;     // ring of cap slots, count of them from head
+   int head, count, cap;
+   int bound;        // most values queued at once
+   bool closed;      // nothing is sent after the values queued
+   ltask *waiting;   // tasks waiting for a value, first served first
+   ltask *sending;   // tasks waiting for room, with their value in got
 };
 
 struct lenv {
@@ -66,143 +211,813 @@ struct lenv {
    int count; // number of entries in syms and vals
    char **syms;
    lval **vals;
+   bool shadows; // '=' put a builtin or a constant here
+};
+
+// heap statistics, printed by 'heap' and on exit with --stats
+struct {
+   bool timed;         // measure release pauses
+   long allocs;
+   long frees;
+   long live;          // values currently alive
+   size_t bytes;       // held by values, strings, cells and environments
+   size_t peak;
+   int depth;          // nesting of the release in progress
+   long releases;      // releases that freed more than one value
+   long max_release;   // most values freed by a single release
+   double pause;       // total time spent releasing, in ms
+   double max_pause;
+} lstats;
+
+// hash-consing, on with --intern. values read from source or decoded
+// from a file share the node of an identical value that is alive
+// already, so repeated data is stored once. the table holds a
+// reference to every node in it, which keeps them shared and so never
+// mutated: everyone else copies on write. nodes nothing else refers to
+// any more are dropped when the table fills up
+struct {
+   bool on;
+   lval **slots;
+   size_t cap;
+   size_t count;
+   long lookups;
+   long hits;
+   size_t saved;   // bytes of values dropped for the one in the table
+} lintern;
+
+// constant folding, see lval_fold. folded values hold as long as the
+// epoch they were computed in is current and nothing shadows a builtin
+// or a constant from outside the global environment
+struct {
+   unsigned epoch;     // bumped whenever a builtin or constant is rebound
+   int shadow;         // calls and environments shadowing one right now
+} lfold = { 1, 0 };
+
+// --reference turns off the optimized evaluation paths, folding and
+// special forms, leaving the plain tree walk they are checked against
+bool lreference;
+
+bool lfold_valid(lval *v) {
+   return v->fold && v->epoch == lfold.epoch && !lfold.shadow;
+}
+
+double lclock_ms() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// limits a top level evaluation runs under, 0 for no limit. once one
+// is exceeded every further step fails, so the evaluation unwinds
+// through the usual error paths
+enum {
+   LLIMIT_STEPS = 1,
+   LLIMIT_DEPTH,
+   LLIMIT_HEAP,
+   LLIMIT_TIME,
+};
+
+struct {
+   bool active;        // any limit is set
+   long max_steps;     // evaluations and calls
+   int max_depth;      // nested lambda calls
+   size_t max_heap;    // bytes held by values, as counted in lstats
+   double max_time;    // wall time in ms
+   long steps;
+   int depth;
+   double start;
+   int exceeded;       // limit hit by the evaluation in progress
+} llimit;
+
+// start counting a new top level evaluation
+void llimit_start() {
+   llimit.steps = 0;
+   llimit.depth = 0;
+   llimit.exceeded = 0;
+   if (llimit.max_time)
+      llimit.start = lclock_ms();
+}
+
+// execution tracing, on with --trace FILE. calls, errors, heap growth
+// and task switches are recorded as events in a ring that keeps the
+// most recent of them, written to FILE when the program exits or
+// crashes. trace/dump renders the file as a timeline. recording an
+// event reads the clock and fills one slot, the ring is never locked
+// as the interpreter runs on a single thread
+enum {
+   LTRACE_ENTER = 1,   // call of a function, builtin or lambda
+   LTRACE_EXIT,        // return from it
+   LTRACE_ERROR,       // error raised
+   LTRACE_HEAP,        // heap grew by LTRACE_HEAP_STEP since the last
+   LTRACE_TASK,        // switch to another task
 };
 
+#define LTRACE_MAGIC "LSPYTRC1"
+#define LTRACE_HEAP_STEP (1 << 20)
+
+typedef struct {
+   uint64_t time;      // ticks of ltrace_clock
+   uint64_t what;      // function, error template, heap bytes or task
+   uint32_t kind;
+   uint32_t depth;     // of nested lambda calls, as in llimit
+} ltrace_event;
+
+// a trace file is this header, the events oldest first and then
+// names of what they refer to, each an ltrace_name up to the end
+typedef struct {
+   char magic[8];
+   uint64_t count;     // events in the file
+   uint64_t lost;      // older events the ring had no room for
+   uint64_t main;      // task the program started in
+   double ticks_per_ms;
+} ltrace_header;
+
+// followed by len bytes of the name
+typedef struct {
+   uint64_t what;
+   uint32_t len;
+} ltrace_name;
+
+struct {
+   bool on;
+   char *path;
+   ltrace_event *ring;
+   uint64_t mask;      // slots in the ring less one, a power of two
+   uint64_t next;      // events recorded so far
+   uint64_t start;     // ticks and ms when tracing started, to convert
+   double start_ms;
+   size_t heap_mark;   // heap size that records the next LTRACE_HEAP
+   lenv *env;          // names the lambdas when the trace is written
+   pid_t pid;          // of the process that started tracing
+} ltrace;
+
+// ticks of the time stamp counter where there is one, ns otherwise
+static inline uint64_t ltrace_clock() {
+#if defined(__x86_64__)
+   uint32_t lo, hi;
+   __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+   return (uint64_t)hi << 32 | lo;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void ltrace_record(int kind, uint64_t what) {
+   ltrace_event *ev = &ltrace.ring[ltrace.next++ & ltrace.mask];
+   ev->time = ltrace_clock();
+   ev->what = what;
+   ev->kind = kind;
+   ev->depth = llimit.depth;
+
+   // the heap shrank, so the next spike is recorded from here
+   if (lstats.bytes + 2 * LTRACE_HEAP_STEP < ltrace.heap_mark)
+      ltrace.heap_mark = lstats.bytes + LTRACE_HEAP_STEP;
+}
+
+void ltrace_heap() {
+   ltrace.heap_mark = lstats.bytes + LTRACE_HEAP_STEP;
+   ltrace_record(LTRACE_HEAP, lstats.bytes);
+}
+
+// grow the heap count by n bytes
+void lstats_grow(size_t n) {
+   lstats.bytes += n;
+   if (lstats.bytes > lstats.peak)
+      lstats.peak = lstats.bytes;
+   if (llimit.max_heap && lstats.bytes > llimit.max_heap)
+      llimit.exceeded = LLIMIT_HEAP;
+   if (ltrace.on && lstats.bytes >= ltrace.heap_mark)
+      ltrace_heap();
+}
+
+void *lmem_alloc(size_t n) {
+   lstats_grow(n);
+   return malloc(n);
+}
+
+void *lmem_realloc(void *p, size_t old, size_t n) {
+   lstats_grow(n - old);
+   return realloc(p, n);
+}
+
+void lmem_free(void *p, size_t n) {
+   lstats.bytes -= n;
+   free(p);
+}
+
+char *lstr_new(char *s) {
+   char *x = lmem_alloc(strlen(s) + 1);
+   strcpy(x, s);
+   return x;
+}
+
+void lstr_free(char *s) {
+   lmem_free(s, strlen(s) + 1);
+}
+
+// freed values are kept for reuse instead of going back to malloc,
+// the body field links them together
+static lval *lval_pool;
+
+lval *lval_alloc(int type) {
+   lval *v = lval_pool;
+   if (v) {
+      lval_pool = v->body;
+      lstats_grow(sizeof(lval));
+   } else {
+      v = lmem_alloc(sizeof(lval));
+   }
+   lstats.allocs++;
+   lstats.live++;
+   v->type = type;
+   v->refs = 1;
+   v->fold = NULL;
+   v->epoch = 0;
+   v->interned = false;
+   return v;
+}
+
+void lval_free(lval *v) {
+   lstats.frees++;
+   lstats.live--;
+   lstats.bytes -= sizeof(lval);
+   v->body = lval_pool;
+   lval_pool = v;
+}
+
+// share v with another owner
+lval *lval_ref(lval *v) {
+   v->refs++;
+   return v;
+}
+
 // number type lval
 lval *lval_num(double x) {
-   lval* v = malloc(sizeof(lval));
-   v->type = LVAL_NUM;
+   lval* v = lval_alloc(LVAL_NUM);
+   v->num = x;
+   v->exact = false;
+   return v;
+}
+
+// exact integer number lval
+lval *lval_int(long x) {
+   lval* v = lval_alloc(LVAL_NUM);
    v->num = x;
+   v->inum = x;
+   v->exact = true;
+   return v;
+}
+
+// skip the conversion specification at p, just past its '%'. sets
+// the conversion character and whether it takes a long
+char *lerr_spec(char *p, char *conv, bool *wide) {
+   p += strspn(p, "-+ #0123456789.");
+   *wide = false;
+   while (*p == 'l' || *p == 'z' || *p == 'h') {
+      *wide = *wide || *p != 'h';
+      p++;
+   }
+   *conv = *p;
+   return *p ? p + 1 : p;
+}
+
+// error type lval. raising an error only records the template and its
+// arguments, the message is formatted when it is printed or compared.
+// string arguments must be static or point into held, which the error
+// takes and keeps until it is deleted
+lval *lval_verr(lval *held, char *fmt, va_list va) {
+   lval *v = lval_alloc(LVAL_ERR);
+   v->err = lmem_alloc(sizeof(lerr));
+   v->err->text = NULL;
+   v->err->fmt = fmt;
+   v->err->held = held;
+   if (ltrace.on)
+      ltrace_record(LTRACE_ERROR, (uintptr_t)fmt);
+
+   int n = 0;
+   for (char *p = fmt; *p; ) {
+      if (*p++ != '%')
+         continue;
+      char conv;
+      bool wide;
+      p = lerr_spec(p, &conv, &wide);
+      lerrarg x;
+      switch (conv) {
+         case 'd': case 'i': case 'u': case 'x': case 'c':
+            x.i = wide ? va_arg(va, long) : va_arg(va, int);
+            break;
+         case 'e': case 'f': case 'g':
+            x.d = va_arg(va, double);
+            break;
+         case 's':
+            x.s = va_arg(va, char*);
+            break;
+         default:
+            continue;
+      }
+      if (n < LERR_ARGS)
+         v->err->argv[n++] = x;
+   }
    return v;
 }
 
-// error type lval
 lval *lval_err(char *fmt, ...) {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_ERR;
+   va_list va;
+   va_start(va, fmt);
+   lval *v = lval_verr(NULL, fmt, va);
+   va_end(va);
+   return v;
+}
 
+lval *lval_err_in(lval *held, char *fmt, ...) {
    va_list va;
    va_start(va, fmt);
+   lval *v = lval_verr(held, fmt, va);
+   va_end(va);
+   return v;
+}
+
+// count a step of the evaluation in progress, returning an error if
+// it exceeded a limit. the clock is only read every few hundred steps
+lval *llimit_step() {
+   llimit.steps++;
+   if (llimit.max_steps && llimit.steps > llimit.max_steps)
+      llimit.exceeded = LLIMIT_STEPS;
+   if (llimit.max_time && (llimit.steps & 255) == 0
+      && lclock_ms() - llimit.start > llimit.max_time)
+      llimit.exceeded = LLIMIT_TIME;
+
+   switch (llimit.exceeded) {
+      case LLIMIT_STEPS:
+         return lval_err("Evaluation exceeded %li steps.", llimit.max_steps);
+      case LLIMIT_DEPTH:
+         return lval_err("Evaluation exceeded a call depth of %i.",
+            llimit.max_depth);
+      case LLIMIT_HEAP:
+         return lval_err("Evaluation exceeded %zu KB of heap.",
+            llimit.max_heap / 1024);
+      case LLIMIT_TIME:
+         return lval_err("Evaluation exceeded %g ms.", llimit.max_time);
+   }
+   return NULL;
+}
 
-   v->err = malloc(512);
-   vsnprintf(v->err, 511, fmt, va);
+// the message of error v
+char *lval_err_text(lval *v) {
+   if (v->err->text)
+      return v->err->text;
+
+   char buf[512];
+   size_t len = 0;
+   int n = 0;
+   for (char *p = v->err->fmt; *p && len < sizeof(buf) - 1; ) {
+      if (*p != '%') {
+         buf[len++] = *p++;
+         continue;
+      }
 
-   // reduce allocated amount to actually used
-   v->err = realloc(v->err, strlen(v->err) + 1);
-   va_end(va);
+      // print each argument with its own specification
+      char *start = p++;
+      char conv;
+      bool wide;
+      p = lerr_spec(p, &conv, &wide);
+      char spec[16];
+      snprintf(spec, sizeof(spec), "%.*s", (int)(p - start), start);
+
+      size_t room = sizeof(buf) - len;
+      int w = 0;
+      lerrarg x = n < LERR_ARGS ? v->err->argv[n] : (lerrarg){ 0 };
+      switch (conv) {
+         case 'd': case 'i': case 'u': case 'x': case 'c':
+            n++;
+            w = wide ? snprintf(buf + len, room, spec, x.i)
+               : snprintf(buf + len, room, spec, (int)x.i);
+            break;
+         case 'e': case 'f': case 'g':
+            n++;
+            w = snprintf(buf + len, room, spec, x.d);
+            break;
+         case 's':
+            n++;
+            w = snprintf(buf + len, room, spec, x.s ? x.s : "");
+            break;
+         case '%':
+            w = snprintf(buf + len, room, "%%");
+            break;
+      }
+      len += w < (int)room ? w : room - 1;
+   }
+   buf[len] = '\0';
 
-   return v;
+   v->err->text = lstr_new(buf);
+   return v->err->text;
 }
 
 // symbol type lval
 lval *lval_sym(char *s) {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_SYM;
-   v->sym = malloc(strlen(s) + 1);
-   strcpy(v->sym, s);
+   lval *v = lval_alloc(LVAL_SYM);
+   v->sym = lstr_new(s);
    return v;
 }
 
 // str type lval
 lval *lval_str(char *s) {
-   lval *v = malloc(sizeof(lval)); 
-   v->type = LVAL_STR;
-   v->str = malloc(strlen(s) + 1);
-   strcpy(v->str, s);
+   lval *v = lval_alloc(LVAL_STR);
+   v->str = lstr_new(s);
    return v;
 }
 
 // sexpr type lval
 lval *lval_sexpr() {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_SEXPR;
+   lval *v = lval_alloc(LVAL_SEXPR);
    v->count = 0;
    v->cell = NULL;
+   v->store = NULL;
    return v;
 }
 
 // qexpr type lval
 lval *lval_qexpr() {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_QEXPR;
+   lval *v = lval_alloc(LVAL_QEXPR);
    v->count = 0;
    v->cell = NULL;
+   v->store = NULL;
+   return v;
+}
+
+// channel type lval queueing up to bound values
+lval *lval_chan(int bound) {
+   lval *v = lval_alloc(LVAL_CHAN);
+   v->chan = lmem_alloc(sizeof(lchan));
+   v->chan->refs = 1;
+   v->chan->items = NULL;
+   v->chan->head = v->chan->count = v->chan->cap = 0;
+   v->chan->bound = bound;
+   v->chan->closed = false;
+   v->chan->waiting = NULL;
+   v->chan->sending = NULL;
+   return v;
+}
+
+// sequence type lval, the fields used by kind are set by the caller
+lval *lval_seq(int kind) {
+   lval *v = lval_alloc(LVAL_SEQ);
+   v->seq = lmem_alloc(sizeof(lseq));
+   v->seq->refs = 1;
+   v->seq->kind = kind;
+   v->seq->from = v->seq->to = v->seq->step = 0;
+   v->seq->fn = NULL;
+   v->seq->src = NULL;
+   v->seq->path = NULL;
    return v;
 }
 
 lenv *lenv_new() {
-   lenv *e = malloc(sizeof(lenv));
+   lenv *e = lmem_alloc(sizeof(lenv));
    e->par = NULL;
    e->count = 0;
    e->syms = NULL;
    e->vals = NULL;
+   e->shadows = false;
    return e;
 }
 
 lval *lval_fun(lbuiltin func) {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_FUN;
+   lval *v = lval_alloc(LVAL_FUN);
    v->builtin = func;
    return v;
 }
 
+bool lfold_watched(char *name);
+
 lval *lval_lambda(lval *formals, lval *body) {
-   lval *v = malloc(sizeof(lval));
-   v->type = LVAL_FUN;
+   lval *v = lval_alloc(LVAL_FUN);
    v->builtin = NULL;
    v->env = lenv_new();
    v->formals = formals;
    v->body = body;
+   v->partial = NULL;
+   v->shadows = false;
+   v->arity = formals->count;
+   v->variadic = false;
+   v->calls = 0;
+   v->jit = NULL;
+   for (int i = 0; i < formals->count; i++) {
+      if (formals->cell[i]->type != LVAL_SYM)
+         continue;
+      if (lfold_watched(formals->cell[i]->sym))
+         v->shadows = true;
+      if (!v->variadic && strcmp(formals->cell[i]->sym, "&") == 0) {
+         v->arity = i;
+         v->variadic = true;
+      }
+   }
+   return v;
+}
+
+// lambda f applied to the first few of its arguments, taking args
+lval *lval_partial(lval *f, lval *args) {
+   lval *v = lval_alloc(LVAL_FUN);
+   v->builtin = NULL;
+   v->partial = f;
+   v->args = args;
+   v->shadows = f->shadows;
+   v->arity = f->arity - args->count;
+   v->variadic = f->variadic;
    return v;
 }
 
 void lval_del(lval *v);
+void ljit_free(ljit *j);
+
+lcells *lcells_new(int cap) {
+   lcells *s = lmem_alloc(sizeof(lcells));
+   s->refs = 1;
+   s->count = 0;
+   s->cap = cap;
+   s->items = lmem_alloc(sizeof(lval*) * cap);
+   s->chunk = NULL;
+   return s;
+}
+
+// storage for n items on the value stack, lists too long for a chunk
+// go to the heap
+lcells *lstack_push(int n) {
+   int slots = LCELLS_SLOTS + n;
+   if (slots > LSTACK_SLOTS)
+      return lcells_new(n);
+
+   lchunk *c = lstack.cur;
+   if (!c || c->top + slots > LSTACK_SLOTS) {
+      if (c && --c->refs > 0)
+         c = NULL;
+      if (!c && lstack.free) {
+         c = lstack.free;
+         lstack.free = c->next;
+         lstats_grow(sizeof(lchunk));
+      } else if (!c) {
+         c = lmem_alloc(sizeof(lchunk));
+      }
+      c->refs = 1;
+      c->top = 0;
+      lstack.cur = c;
+   }
+
+   lcells *s = (lcells *)&c->items[c->top];
+   c->top += slots;
+   c->refs++;
+   s->refs = 1;
+   s->count = 0;
+   s->cap = n;
+   s->items = &c->items[c->top - n];
+   s->chunk = c;
+   return s;
+}
+
+// give the slots of s back to its chunk
+void lstack_pop(lcells *s) {
+   lchunk *c = s->chunk;
+   if (c == lstack.cur && s->items + s->cap == &c->items[c->top])
+      c->top -= LCELLS_SLOTS + s->cap;
+   if (--c->refs == 0) {
+      c->next = lstack.free;
+      lstack.free = c;
+      lstats.bytes -= sizeof(lchunk);
+   }
+}
+
+void lcells_release(lcells *s) {
+   if (--s->refs > 0)
+      return;
+   for (int i = 0; i < s->count; i++)
+      if (s->items[i])
+         lval_del(s->items[i]);
+   if (s->chunk) {
+      lstack_pop(s);
+      return;
+   }
+   lmem_free(s->items, sizeof(lval*) * s->cap);
+   lmem_free(s, sizeof(lcells));
+}
+
+void lseq_release(lseq *s) {
+   if (--s->refs > 0)
+      return;
+   if (s->fn)
+      lval_del(s->fn);
+   if (s->src)
+      lval_del(s->src);
+   if (s->path)
+      lstr_free(s->path);
+   lmem_free(s, sizeof(lseq));
+}
+
+void lchan_release(lchan *c) {
+   if (--c->refs > 0)
+      return;
+   for (int i = 0; i < c->count; i++)
+      lval_del(c->items[(c->head + i) % c->cap]);
+   if (c->items)
+      lmem_free(c->items, sizeof(lval*) * c->cap);
+   lmem_free(c, sizeof(lchan));
+}
 
 void lenv_del(lenv *e) {
+   if (e->shadows)
+      lfold.shadow--;
    for (int i = 0; i < e->count; i++) {
-      free(e->syms[i]);
+      lstr_free(e->syms[i]);
       lval_del(e->vals[i]);
    }
-   free(e->syms);
-   free(e->vals);
-   free(e);
+   if (e->count) {
+      lmem_free(e->syms, sizeof(char*) * e->count);
+      lmem_free(e->vals, sizeof(lval*) * e->count);
+   }
+   lmem_free(e, sizeof(lenv));
 }
  
 void lval_del(lval *v) {
+   if (--v->refs > 0)
+      return;
+
+   // time the outermost release, everything it frees is one pause
+   double start = 0;
+   long frees = lstats.frees;
+   if (lstats.timed && lstats.depth == 0)
+      start = lclock_ms();
+   lstats.depth++;
+
    switch(v->type) {
       case LVAL_NUM: break;
-      case LVAL_ERR: free(v->err); break;
-      case LVAL_SYM: free(v->sym); break; 
-      case LVAL_STR: free(v->str); break; 
+      case LVAL_ERR:
+         if (v->err->text)
+            lstr_free(v->err->text);
+         if (v->err->held)
+            lval_del(v->err->held);
+         lmem_free(v->err, sizeof(lerr));
+         break;
+      case LVAL_SYM: lstr_free(v->sym); break; 
+      case LVAL_STR: lstr_free(v->str); break; 
       case LVAL_SEXPR:
       case LVAL_QEXPR:
-         for (int i = 0; i < v->count; i++)
-            lval_del(v->cell[i]);
-         free(v->cell);
+         if (v->store)
+            lcells_release(v->store);
          break;
       case LVAL_FUN:
-         if (!v->builtin) {
+         if (v->builtin)
+            break;
+         if (v->partial) {
+            lval_del(v->partial);
+            lval_del(v->args);
+         } else {
             lenv_del(v->env);
             lval_del(v->formals);
             lval_del(v->body);
+            if (v->jit)
+               ljit_free(v->jit);
          }
          break;
+      case LVAL_SEQ: lseq_release(v->seq); break;
+      case LVAL_CHAN: lchan_release(v->chan); break;
    }
-   free(v);
-} 
+   if (v->fold)
+      lval_del(v->fold);
+   lval_free(v);
+
+   if (--lstats.depth == 0 && lstats.frees - frees > 1) {
+      lstats.releases++;
+      if (lstats.frees - frees > lstats.max_release)
+         lstats.max_release = lstats.frees - frees;
+      if (lstats.timed) {
+         double pause = lclock_ms() - start;
+         lstats.pause += pause;
+         if (pause > lstats.max_pause)
+            lstats.max_pause = pause;
+      }
+   }
+}
+
+void lstats_print(FILE *f) {
+   fprintf(f, "heap: %ld live values, %zu bytes, %zu peak bytes\n",
+      lstats.live, lstats.bytes, lstats.peak);
+   fprintf(f, "heap: %ld allocations, %ld frees\n",
+      lstats.allocs, lstats.frees);
+   fprintf(f, "heap: %ld releases, largest freed %ld values",
+      lstats.releases, lstats.max_release);
+   if (lstats.timed)
+      fprintf(f, ", pauses %.3f ms total, %.3f ms max",
+         lstats.pause, lstats.max_pause);
+   fputc('\n', f);
+
+   struct rusage ru;
+   if (getrusage(RUSAGE_SELF, &ru) == 0)
+      fprintf(f, "heap: %ld KB peak resident\n", ru.ru_maxrss);
+   if (lintern.on)
+      fprintf(f, "intern: %ld lookups, %ld hits (%.1f%%), %zu values held, "
+         "%zu bytes saved\n", lintern.lookups, lintern.hits,
+         lintern.lookups ? 100.0 * lintern.hits / lintern.lookups : 0.0,
+         lintern.count, lintern.saved);
+}
 
 // read the number type
 lval *lval_read_num(mpc_ast_t *t) {
+   // integers are exact while they fit in a long
    errno = 0;
+   if (!strchr(t->contents, '.')) {
+      long n = strtol(t->contents, NULL, 10);
+      if (errno != ERANGE)
+         return lval_int(n);
+      errno = 0;
+   }
    double x = strtod(t->contents, NULL);
    return errno != ERANGE ?
       lval_num(x) : lval_err("invalid number");
 }
 
+lval *lval_copy(lval *v);
+lval *lval_own(lval *v);
+
+// move the slice of v into the empty storage n
+void lval_move_cells(lval *v, lcells *n) {
+   lcells *s = v->store;
+   for (int i = 0; i < v->count; i++) {
+      if (s && s->refs == 1) {
+         // sole owner, move the values instead of copying them
+         n->items[i] = v->cell[i];
+         v->cell[i] = NULL;
+      } else {
+         n->items[i] = lval_ref(v->cell[i]);
+      }
+   }
+   n->count = v->count;
+
+   if (s)
+      lcells_release(s);
+   v->store = n;
+   v->cell = n->items;
+}
+
+bool lval_private_cells(lval *v) {
+   lcells *s = v->store;
+   return s && s->refs == 1 && v->cell == s->items && v->count == s->count;
+}
+
+// give v a private storage holding exactly its slice
+void lval_own_cells(lval *v) {
+   if (!lval_private_cells(v))
+      lval_move_cells(v, lcells_new(v->count));
+}
+
+// x outlives the call that made it. a list of x still on the value
+// stack moves to the heap, its slots would keep the whole chunk alive
+lval *lstack_escape(lval *x) {
+   switch (x->type) {
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+         if (x->store && x->store->chunk)
+            lval_move_cells(x, lcells_new(x->count));
+         break;
+      case LVAL_FUN:
+         if (!x->builtin && x->partial)
+            lstack_escape(x->args);
+         break;
+      case LVAL_ERR:
+         if (x->err->held)
+            lstack_escape(x->err->held);
+         break;
+   }
+   return x;
+}
+
 lval *lval_add(lval *v, lval *x) {
+   lcells *s = v->store;
+
+   // append in place only if no other slice extends past this one
+   if (!s || v->cell + v->count != s->items + s->count || s->count == s->cap) {
+      lval_own_cells(v);
+      s = v->store;
+      if (s->count == s->cap && s->chunk) {
+         // the value stack cannot grow in place, move to the heap
+         lcells *n = lcells_new(s->cap * 2 + 4);
+         memcpy(n->items, s->items, sizeof(lval*) * s->count);
+         n->count = s->count;
+         s->count = 0;
+         lcells_release(s);
+         v->store = s = n;
+         v->cell = s->items;
+      } else if (s->count == s->cap) {
+         int cap = s->cap ? s->cap * 2 : 4;
+         s->items = lmem_realloc(s->items,
+            sizeof(lval*) * s->cap, sizeof(lval*) * cap);
+         s->cap = cap;
+         v->cell = s->items;
+      }
+   }
+
+   s->items[s->count++] = x;
    v->count++;
-   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-   v->cell[v->count-1] = x;
    return v;
 }
 
@@ -216,6 +1031,152 @@ lval *lval_read_str(mpc_ast_t *t) {
    return str;
 }
 
+// hashes of the values in lintern
+unsigned long lhash_mix(unsigned long h, unsigned long x) {
+   return (h ^ x) * 1099511628211ul;
+}
+
+// slot of hash h in the table. the multiply in lhash_mix only carries
+// low bits upwards, small numbers would all land in the same slots
+size_t lintern_slot(unsigned long h) {
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdul;
+   h ^= h >> 33;
+   return h & (lintern.cap - 1);
+}
+
+unsigned long lhash_str(unsigned long h, char *s) {
+   for (; *s; s++)
+      h = lhash_mix(h, (unsigned char)*s);
+   return h;
+}
+
+// hash of v that values equal under lval_eq share, false if v can not
+// be interned: it is not a number, symbol, string or list of interned
+// values, or it is a number that is not equal to itself or prints as -0
+bool lintern_hash(lval *v, unsigned long *h) {
+   *h = lhash_mix(14695981039346656037ul, v->type);
+   switch (v->type) {
+      case LVAL_NUM: {
+         if (v->num != v->num || (v->num == 0 && signbit(v->num)))
+            return false;
+         // exact numbers compare to inexact ones by their double
+         double d = v->num;
+         unsigned long bits;
+         memcpy(&bits, &d, sizeof(bits));
+         *h = lhash_mix(*h, bits);
+         return true;
+      }
+      case LVAL_SYM: *h = lhash_str(*h, v->sym); return true;
+      case LVAL_STR: *h = lhash_str(*h, v->str); return true;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+         for (int i = 0; i < v->count; i++) {
+            if (!v->cell[i]->interned)
+               return false;
+            *h = lhash_mix(*h, v->cell[i]->hash);
+         }
+         return true;
+      default:
+         return false;
+   }
+}
+
+// x and y behave the same in every way, lists of interned values are
+// when their elements are the same nodes
+bool lintern_same(lval *x, lval *y) {
+   if (x->type != y->type)
+      return false;
+   switch (x->type) {
+      case LVAL_NUM:
+         return x->exact == y->exact
+            && (x->exact ? x->inum == y->inum : x->num == y->num);
+      case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+      case LVAL_STR: return strcmp(x->str, y->str) == 0;
+      default:
+         if (x->count != y->count)
+            return false;
+         for (int i = 0; i < x->count; i++)
+            if (x->cell[i] != y->cell[i])
+               return false;
+         return true;
+   }
+}
+
+// bytes v takes apart from the values it holds
+size_t lval_bytes(lval *v) {
+   size_t n = sizeof(lval);
+   if (v->type == LVAL_SYM) n += strlen(v->sym) + 1;
+   if (v->type == LVAL_STR) n += strlen(v->str) + 1;
+   if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR)
+      n += v->count * sizeof(lval*) + (v->count ? sizeof(lcells) : 0);
+   return n;
+}
+
+void lintern_insert(lval *v) {
+   size_t i = lintern_slot(v->hash);
+   while (lintern.slots[i])
+      i = (i + 1) & (lintern.cap - 1);
+   lintern.slots[i] = v;
+   lintern.count++;
+}
+
+// drop the nodes only the table refers to, then grow it if it is
+// still half full
+void lintern_rehash() {
+   lval **old = lintern.slots;
+   size_t cap = lintern.cap;
+
+   // a node dropped may leave its elements to the table alone, those
+   // go the next time round
+   size_t live = 0;
+   for (size_t i = 0; i < cap; i++) {
+      if (old[i] && old[i]->refs == 1) {
+         lval_del(old[i]);
+         old[i] = NULL;
+      }
+      live += old[i] != NULL;
+   }
+
+   while (live * 2 >= lintern.cap)
+      lintern.cap = lintern.cap ? lintern.cap * 2 : 1024;
+   lintern.slots = lmem_alloc(sizeof(lval*) * lintern.cap);
+   memset(lintern.slots, 0, sizeof(lval*) * lintern.cap);
+   lintern.count = 0;
+   for (size_t i = 0; i < cap; i++)
+      if (old[i])
+         lintern_insert(old[i]);
+   if (old)
+      lmem_free(old, sizeof(lval*) * cap);
+}
+
+// the node in the table identical to v, which is put there if there is
+// none. v is taken either way
+lval *lintern_value(lval *v) {
+   unsigned long h;
+   if (!lintern.on || v->interned || !lintern_hash(v, &h))
+      return v;
+
+   lintern.lookups++;
+   if (lintern.count * 2 >= lintern.cap)
+      lintern_rehash();
+   size_t i = lintern_slot(h);
+   for (lval *x; (x = lintern.slots[i]); i = (i + 1) & (lintern.cap - 1)) {
+      if (x->hash == h && lintern_same(x, v)) {
+         lintern.hits++;
+         lintern.saved += lval_bytes(v);
+         lval_del(v);
+         return lval_ref(x);
+      }
+   }
+
+   v->interned = true;
+   v->hash = h;
+   lintern.slots[i] = v;
+   lintern.count++;
+   return lval_ref(v);
+}
+
 lval *lval_read(mpc_ast_t *t) {
    if (strstr(t->tag, "number")) return lval_read_num(t);
    if (strstr(t->tag, "symbol")) return lval_sym(t->contents); 
@@ -233,7 +1194,7 @@ lval *lval_read(mpc_ast_t *t) {
       if (strcmp(t->children[i]->contents, ")") == 0) continue;
       if (strcmp(t->children[i]->tag, "regex") == 0)  continue;
       if (strstr(t->children[i]->tag, "comment"))     continue;
-      x = lval_add(x, lval_read(t->children[i]));
+      x = lval_add(x, lintern_value(lval_read(t->children[i])));
    }
    return x;
 }
@@ -260,26 +1221,43 @@ void lval_print_str(lval *v) {
 
 void lval_function_print(lbuiltin f);
 
+// a lambda without its first skip formals
+void lval_lambda_print(lval *f, int skip) {
+   printf("(\\ {");
+   for (int i = skip; i < f->formals->count; i++) {
+      lval_print(f->formals->cell[i]);
+      if (i != f->formals->count - 1)
+         putchar(' ');
+   }
+   printf("} ");
+   lval_print(f->body);
+   putchar(' ');
+}
+
 // print lval type 
 void lval_print(lval *v) {
    switch (v->type) {
-      case LVAL_NUM: printf("%g", v->num); break;
+      case LVAL_NUM:
+         if (v->exact)
+            printf("%ld", v->inum);
+         else
+            printf("%g", v->num);
+         break;
       case LVAL_SYM: printf("%s", v->sym); break;
       case LVAL_STR: lval_print_str(v); break;
       case LVAL_SEXPR: lval_expr_print(v, '(', ')'); break;
       case LVAL_QEXPR: lval_expr_print(v, '{', '}'); break;
       case LVAL_FUN: 
-         if (v->builtin) { 
+         if (v->builtin)
             lval_function_print(v->builtin); 
-         } else {
-            printf("(\\ ");
-            lval_print(v->formals);
-            putchar(' ');
-            lval_print(v->body);
-            putchar(' ');
-         }
+         else if (v->partial)
+            lval_lambda_print(v->partial, v->args->count);
+         else
+            lval_lambda_print(v, 0);
          break;
-      case LVAL_ERR: printf("Error: %s", v->err); break;
+      case LVAL_SEQ: printf("<sequence>"); break;
+      case LVAL_CHAN: printf("<channel>"); break;
+      case LVAL_ERR: printf("Error: %s", lval_err_text(v)); break;
    }
 }
 
@@ -290,15 +1268,37 @@ void lval_println(lval *v) {
 }
 
 lval *lval_pop(lval *v, int i) {
-   // fint the item at i'th index
+   lcells *s = v->store;
+
+   // popping either end only narrows the slice
+   if (i == 0 || i == v->count - 1) {
+      lval **slot = &v->cell[i];
+      lval *x;
+      if (s->refs == 1) {
+         x = *slot;
+         *slot = NULL;
+         if (slot == &s->items[s->count - 1])
+            s->count--;
+      } else {
+         x = lval_ref(*slot);
+      }
+
+      if (i == 0)
+         v->cell++;
+      v->count--;
+      return x;
+   }
+
+   lval_own_cells(v);
+
+   // find the item at i'th index
    lval *x = v->cell[i];
 
    // shift memory
    memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
 
    v->count--;
-
-   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+   v->store->count--;
    return x;
 }
 
@@ -311,6 +1311,8 @@ lval *lval_take(lval *v, int i) {
 char *ltype_name(int t) {
    switch (t) {
       case LVAL_FUN:    return "Function";
+      case LVAL_SEQ:    return "Sequence";
+      case LVAL_CHAN:   return "Channel";
       case LVAL_NUM:    return "Number";
       case LVAL_ERR:    return "Error";
       case LVAL_SYM:    return "Symbol";
@@ -322,6 +1324,10 @@ char *ltype_name(int t) {
 }
 
 lval *lval_eval(lenv *e, lval *v);
+lval *lval_fold(lenv *e, lval *v);
+
+lval *lmodule_load(lenv *e, lval *a);
+lval *lcache_read(char *path, mpc_err_t **err);
 
 lval *builtin_load(lenv *e, lval *a) {
    LASSERT(a, a->count == 1,
@@ -334,13 +1340,16 @@ lval *builtin_load(lenv *e, lval *a) {
       "Got %s, expected %s.",
       ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
 
-   mpc_result_t r;
-   if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-      lval *expr = lval_read(r.output);
-      mpc_ast_delete(r.output);
+   // a module written by --compile-c
+   char *path = a->cell[0]->str;
+   if (strlen(path) > 3 && strcmp(path + strlen(path) - 3, ".so") == 0)
+      return lmodule_load(e, a);
 
+   mpc_err_t *err;
+   lval *expr = lcache_read(path, &err);
+   if (expr) {
       while (expr->count) {
-         lval *x = lval_eval(e, lval_pop(expr, 0));
+         lval *x = lval_eval(e, lval_fold(e, lval_pop(expr, 0)));
          lval_println(x);
          lval_del(x);
       }
@@ -351,11 +1360,12 @@ lval *builtin_load(lenv *e, lval *a) {
       return lval_sym("ok");
 
    } else {
-      char *err_msg = mpc_err_string(r.error);
-      lval *err = lval_err("Could not load Library %s", err_msg);
+      char *err_msg = mpc_err_string(err);
+      mpc_err_delete(err);
+      lval *msg = lval_str(err_msg);
       free(err_msg);
       lval_del(a);
-      return err;
+      return lval_err_in(msg, "Could not load Library %s", msg->str);
    }
 }
 
@@ -402,9 +1412,57 @@ lval *builtin_error(lenv *e, lval *a) {
       "Got %s, expected %s.",
       ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
 
-   lval *err = lval_err(a->cell[0]->str);
-   lval_del(a);
-   return err;
+   return lval_err_in(a, "%s", a->cell[0]->str);
+}
+
+// x op y into x when both are exact integers and so is the result,
+// false when it has to be computed in doubles instead. overflow of a
+// long counts as inexact
+bool lval_int_op(lval *x, lval *y, char *op) {
+   long a = x->inum, b = y->inum, r;
+   switch (*op) {
+      case '+':
+         if (__builtin_add_overflow(a, b, &r))
+            return false;
+         break;
+      case '-':
+         if (__builtin_sub_overflow(a, b, &r))
+            return false;
+         break;
+      case '*':
+         if (__builtin_mul_overflow(a, b, &r))
+            return false;
+         break;
+      case '/':
+         if (b == -1 && a == LONG_MIN)
+            return false;
+         if (a % b != 0)
+            return false;
+         r = a / b;
+         break;
+      case '%':
+         // same sign as a, like fmod
+         r = b == -1 ? 0 : a % b;
+         break;
+      case '^':
+         if (b < 0)
+            return false;
+         // square and multiply
+         r = 1;
+         while (b) {
+            if (b & 1 && __builtin_mul_overflow(r, a, &r))
+               return false;
+            b >>= 1;
+            if (b && __builtin_mul_overflow(a, a, &a))
+               return false;
+         }
+         break;
+      default:
+         return false;
+   }
+   x->inum = r;
+   x->num = r;
+   return true;
 }
 
 lval *builtin_op(lenv *e, lval* a, char *op) {
@@ -416,42 +1474,42 @@ lval *builtin_op(lenv *e, lval* a, char *op) {
    }
 
    // pop first element
-   lval *x = lval_pop(a, 0);
+   lval *x = lval_own(lval_pop(a, 0));
 
    // if no args and sub then unary negation
-   if ((strcmp(op, "-") == 0) && a->count == 0)
+   if ((strcmp(op, "-") == 0) && a->count == 0) {
+      x->exact = x->exact && x->inum != LONG_MIN;
+      x->inum = x->exact ? -x->inum : 0;
       x->num = -x->num;
+   }
 
    while (a->count > 0) {
       lval *y = lval_pop(a, 0);
 
-      if (strcmp(op, "+") == 0) x->num += y->num;           
-      if (strcmp(op, "-") == 0) x->num -= y->num;
-      if (strcmp(op, "*") == 0) x->num *= y->num;
-      if (strcmp(op, "/") == 0) {
-         if (y->num == 0) {
-            lval_del(x);
-            lval_del(y);
-            x = lval_err("Division by zero!"); break;
-         }
-         x->num /= y->num;
+      if ((strcmp(op, "/") == 0 || strcmp(op, "%") == 0) && y->num == 0) {
+         lval_del(x);
+         lval_del(y);
+         x = lval_err("Division by zero!"); break;
       }
-      if (strcmp(op, "%") == 0) {
-         if (y->num == 0) {
-            lval_del(x);
-            lval_del(y);
-            x = lval_err("Division by zero!"); break;
-         }
-         x->num = fmod(x->num, y->num);
+      if (strcmp(op, "^") == 0 && y->num == 0 && x->num == 0) {
+         lval_del(x);
+         lval_del(y);
+         x = lval_err("0^0 is undefined!"); break;
       }
-      if (strcmp(op, "^") == 0) {
-         if (y->num == 0 && x->num == 0) {
-            lval_del(x);
-            lval_del(y);
-            lval_err("0^0 is undefined!"); break;
-         }
-         x->num = pow(x->num, y->num);
+
+      // integers stay exact until a result is not one
+      if (x->exact && y->exact && lval_int_op(x, y, op)) {
+         lval_del(y);
+         continue;
       }
+      x->exact = false;
+
+      if (strcmp(op, "+") == 0) x->num += y->num;           
+      if (strcmp(op, "-") == 0) x->num -= y->num;
+      if (strcmp(op, "*") == 0) x->num *= y->num;
+      if (strcmp(op, "/") == 0) x->num /= y->num;
+      if (strcmp(op, "%") == 0) x->num = fmod(x->num, y->num);
+      if (strcmp(op, "^") == 0) x->num = pow(x->num, y->num);
       lval_del(y);
    }
    lval_del(a);
@@ -489,18 +1547,21 @@ lval *builtin_ord(lenv *e, lval *a, char *op) {
       LASSERT(a, a->cell[i]->type == LVAL_NUM,
          "2");
 
+   // exact integers compare exactly, past 2^53 too
+   lval *x = a->cell[0], *y = a->cell[1];
+   bool exact = x->exact && y->exact;
    int r;
    if (strcmp(op, ">") == 0)
-      r = (a->cell[0]->num > a->cell[1]->num);
+      r = exact ? x->inum > y->inum : x->num > y->num;
    if (strcmp(op, "<") == 0)
-      r = (a->cell[0]->num < a->cell[1]->num);
+      r = exact ? x->inum < y->inum : x->num < y->num;
    if (strcmp(op, ">=") == 0)
-      r = (a->cell[0]->num >= a->cell[1]->num);
+      r = exact ? x->inum >= y->inum : x->num >= y->num;
    if (strcmp(op, "<=") == 0)
-      r = (a->cell[0]->num <= a->cell[1]->num);
+      r = exact ? x->inum <= y->inum : x->num <= y->num;
    
    lval_del(a);
-   return lval_num(r);
+   return lval_int(r);
 }
 
 lval *builtin_gt(lenv *e, lval* a) {
@@ -519,21 +1580,35 @@ lval *builtin_ge(lenv *e, lval* a) {
 
 // check if two lvals are equal
 int lval_eq(lval *x, lval *y) {
+   if (x == y)
+      return 1;
    if (x->type != y->type)
       return 0;
+   if (x->interned && y->interned && x->hash != y->hash)
+      return 0;
 
    switch(x->type) {
-      case LVAL_NUM: return x->num == y->num;
-      case LVAL_ERR: return (strcmp(x->err, y->err) == 0);
+      case LVAL_NUM:
+         return x->exact && y->exact ? x->inum == y->inum
+            : x->num == y->num;
+      case LVAL_ERR:
+         return strcmp(lval_err_text(x), lval_err_text(y)) == 0;
       case LVAL_SYM: return (strcmp(x->sym, y->sym) == 0);
       case LVAL_STR: return (strcmp(x->str, y->str) == 0);
       case LVAL_FUN:
          if (x->builtin || y->builtin)
             return x->builtin == y->builtin;
+         else if (x->partial || y->partial)
+            return x->partial && y->partial
+               && lval_eq(x->partial, y->partial)
+               && lval_eq(x->args, y->args);
          else
             // comparse function arguments and body
             return lval_eq(x->formals, y->formals) &&
                    lval_eq(x->body, y->body);
+      // sequences and channels are equal when they are the same one
+      case LVAL_SEQ: return x->seq == y->seq;
+      case LVAL_CHAN: return x->chan == y->chan;
       case LVAL_SEXPR:
       case LVAL_QEXPR: 
          if (x->count != y->count) 
@@ -559,7 +1634,7 @@ lval *builtin_cmp(lenv *e, lval *a, char *op) {
          r = !lval_eq(a->cell[0], a->cell[1]);
 
       lval_del(a);
-      return lval_num(r);
+      return lval_int(r);
 }
 
 lval *builtin_eq(lenv *e, lval *a) {
@@ -571,10 +1646,12 @@ lval *builtin_ne(lenv *e, lval *a) {
 }
 
 
+lval *lval_eval_sexpr(lenv *e, lval *v);
+
 lval *builtin_if(lenv *e, lval *a) {
    LASSERT(a, a->count == 3,
       "Function 'if' passed incorrect number of arguments. "
-      "Got %s, expected %s.",
+      "Got %i, expected %i.",
       a->count, 3);
 
    for (int i = 0; i < a->count; i++) {
@@ -585,24 +1662,16 @@ lval *builtin_if(lenv *e, lval *a) {
          i, ltype_name(a->cell[i]->type), ltype_name(type));
    }
 
-   lval *x;
-   a->cell[1]->type = LVAL_SEXPR;
-   a->cell[2]->type = LVAL_SEXPR;
-
-   if (a->cell[0]->num)
-      x = lval_eval(e, lval_pop(a, 1));
-   else
-      x = lval_eval(e, lval_pop(a, 2));
-
+   // evaluate the branch's contents as an S-Expression
+   lval *x = lval_pop(a, a->cell[0]->num ? 1 : 2);
    lval_del(a);
-   return x;
+   return lval_eval_sexpr(e, x);
 }
 
 void lenv_put(lenv *e, lval *k, lval *v);
 
-void lenv_add_var(lenv *e, char *name, double x) {
+void lenv_add_var(lenv *e, char *name, lval *v) {
    lval *k = lval_sym(name);
-   lval *v = lval_num(x);
    lenv_put(e, k, v);
    lval_del(k);
    lval_del(v);
@@ -615,6 +1684,12 @@ lval *builtin_env(lenv *e, lval *a) {
    return NULL;
 }
 
+lval *builtin_heap(lenv *e, lval *a) {
+   lstats_print(stdout);
+   lval_del(a);
+   return lval_sym("ok");
+}
+
 lval *builtin_exit(lenv *e, lval *a) {
    exit(1);
    return NULL;
@@ -660,9 +1735,10 @@ lval *builtin_not(lenv *e, lval *a) {
       ltype_name(a->cell[0]->type), ltype_name(LVAL_NUM));
 
       lval *x = lval_pop(a, 0);
-      x->num = !(x->num);
+      lval *r = lval_int(!x->num);
+      lval_del(x);
       lval_del(a);
-      return x;
+      return r;
 }
 
 lval *builtin_or(lenv *e, lval *a) {
@@ -677,12 +1753,9 @@ lval *builtin_or(lenv *e, lval *a) {
          "Got %s, expected %s.",
          i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
    }
-      lval *x = lval_pop(a, 0);
-      lval *y = lval_pop(a, 0);
-      x->num = x->num || y->num;
-      lval_del(y);
+      lval *r = lval_int(a->cell[0]->num || a->cell[1]->num);
       lval_del(a);
-      return x;
+      return r;
 }
 
 lval *builtin_and(lenv *e, lval *a) {
@@ -697,12 +1770,9 @@ lval *builtin_and(lenv *e, lval *a) {
          "Got %s, expected %s.",
          i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
    }
-      lval *x = lval_pop(a, 0);
-      lval *y = lval_pop(a, 0);
-      x->num = x->num && y->num;
-      lval_del(y);
+      lval *r = lval_int(a->cell[0]->num && a->cell[1]->num);
       lval_del(a);
-      return x;
+      return r;
 }
 
 lval *builtin_head(lenv *e, lval* a) {
@@ -721,19 +1791,19 @@ lval *builtin_head(lenv *e, lval* a) {
          "Function 'head' passed {}!");
 
    // take first element
-   lval *v = lval_take(a, 0);
+   lval *v = lval_own(lval_take(a, 0));
 
    if (v->type == LVAL_STR) {
       if (strlen(v->str) > 0) {
-         v->str = realloc(v->str, 2);
+         v->str = lmem_realloc(v->str, strlen(v->str) + 1, 2);
          v->str[1] = '\0';
       }
       return v;
    }
 
-   // remove every element until one remains
-   while (v->count > 1)
-      lval_del(lval_pop(v, 1));
+   // narrow the list down to its first element, the cells past it
+   // stay in the storage until it is released
+   v->count = 1;
    return v;
 }
 
@@ -753,12 +1823,15 @@ lval *builtin_tail(lenv *e, lval *a) {
          "Function 'tail' passed {}!");
 
    // take first element
-   lval *v = lval_take(a, 0);
-   if (v->type == LVAL_STR)
+   lval *v = lval_own(lval_take(a, 0));
+   if (v->type == LVAL_STR) {
       // remove first character from the string
-      memmove(v->str, v->str + 1, strlen(v->str));
-   else
+      char *str = v->str;
+      v->str = lstr_new(str[0] ? str + 1 : str);
+      lstr_free(str);
+   } else {
       lval_del(lval_pop(v, 0));
+   }
    return v;
 }
 
@@ -778,10 +1851,21 @@ lval *builtin_fun(lenv *e, lval *a) {
          "Got %s, expected %s.",
          i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
 
-   lval *name = lval_pop(a->cell[0], 0);
-   lval *args = a->cell[0];
-   lval *body = a->cell[1];
-   lenv_def(e, name, lval_lambda(args, body));
+   LASSERT(a, a->cell[0]->count != 0,
+      "Function 'fun' passed {}!");
+
+   for (int i = 0; i < a->cell[0]->count; i++)
+      LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+         "Cannot define non-symbol. Got %s, expected %s.",
+         ltype_name(a->cell[0]->cell[i]->type), ltype_name(LVAL_SYM));
+
+   lval *args = lval_own(lval_pop(a, 0));
+   lval *body = lval_pop(a, 0);
+   lval *name = lval_pop(args, 0);
+   lval *f = lval_lambda(args, body);
+   lenv_def(e, name, f);
+   lval_del(name);
+   lval_del(f);
    lval_del(a);
    return lval_sym("ok");
 }
@@ -793,12 +1877,15 @@ lval *builtin_list(lenv *e, lval *a) {
 }
 
 lval *lval_join(lval *x, lval *y) {
+   x = lval_own(x);
    if (x->type == LVAL_STR && y->type == LVAL_STR) {
       // concatenate y string into x string
+      size_t len = strlen(x->str);
+      x->str = lmem_realloc(x->str, len + 1, len + strlen(y->str) + 1);
       strcat(x->str, y->str);
    } else { 
-      while(y->count)
-         x = lval_add(x, lval_pop(y, 0));
+      for (int i = 0; i < y->count; i++)
+         x = lval_add(x, lval_ref(y->cell[i]));
    }
 
    lval_del(y);
@@ -823,26 +1910,27 @@ lval *builtin_join(lenv *e, lval *a) {
    return x;
 }
 
-// TODO: Add a builtin function cons that takes a value and a 
-// Q-Expression and appends it to the front.
+// add a value to the front of a Q-Expression
 lval *builtin_cons(lenv *e, lval *a) {
    LASSERT(a, a->count == 2,
-      "Function 'cons' passed incorrect number of arguments!");
+      "Function 'cons' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 2);
 
-   a->cell[0] = builtin_list(e, a->cell[0]);
-   a->cell[0]->count = 1;
-   printf("%g\n", a->cell[0]->num);
-   printf("%d\n", a->cell[0]->count);
-   lval *v = builtin_join(e, a);
-   return v;
+   LASSERT(a, a->cell[1]->type == LVAL_QEXPR,
+      "Function 'cons' passed incorrect type for argument 1. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[1]->type), ltype_name(LVAL_QEXPR));
 
+   lval *x = lval_add(lval_qexpr(), lval_pop(a, 0));
+   return lval_join(x, lval_take(a, 0));
 }
 
 // return the length of a list
 lval *builtin_len(lenv *e, lval *a) {
    LASSERT(a, a->count == 1,
       "Function 'len' passed too many arguments. "
-      "Got %s, expected %s.",
+      "Got %i, expected %i.",
       a->count, 1); 
 
    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
@@ -853,20 +1941,18 @@ lval *builtin_len(lenv *e, lval *a) {
    LASSERT(a, a->cell[0]->count != 0,
       "Function 'len' passed {}!"); 
 
+   // the cells may be shared, so build a new list instead
    lval *v = lval_take(a, 0);
-   v->cell[0]->num = v->count;
-
-   // remove every element until one remains
-   while (v->count > 1)
-      lval_del(lval_pop(v, 1));
-   return v;
+   lval *x = lval_add(lval_qexpr(), lval_int(v->count));
+   lval_del(v);
+   return x;
 }
 
 // return a list without the last element
 lval *builtin_init(lenv *e, lval *a) {
    LASSERT(a, a->count == 1,
       "Function 'init' passed too many arguments. "
-      "Got %s, expected %s.",
+      "Got %i, expected %i.",
       a->count, 1);
 
    LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
@@ -877,353 +1963,2586 @@ lval *builtin_init(lenv *e, lval *a) {
    LASSERT(a, a->cell[0]->count != 0,
       "Function 'init' passed {}!");
    
-   lval *v = lval_take(a, 0);
+   lval *v = lval_own(lval_take(a, 0));
    lval_del(lval_pop(v, v->count - 1));
    return v;
 }
 
-lval *builtin_var(lenv *e, lval *a, char *func);
-
-lval *builtin_def(lenv *e, lval *a) {
-   return builtin_var(e, a, "def");
-}
+// lazy sequences. range, iterate and lines make a sequence, map,
+// filter, take and drop wrap one without producing anything, reduce
+// and collect pull the elements through one at a time. Q-Expressions
+// are accepted wherever a sequence is
 
-lval *builtin_put(lenv *e, lval *a) {
-   return builtin_var(e, a, "=");
-}
+lval *lval_call(lenv *e, lval *fn, lval *a);
 
+typedef struct lcursor lcursor;
 
-lval *builtin_var(lenv *e, lval *a, char *func) {
-   LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-      "Function 'def' passed incorrect type for argument 0. "
-      "Got %s, expected %s",
-      ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+// position in a sequence or Q-Expression being walked
+struct lcursor {
+   lval *v;
+   double i;      // next number of a range, otherwise elements so far
+   bool exact;    // the numbers of a range are integers
+   lval *cur;     // last element of iterate
+   FILE *file;    // file being read by lines
+   lcursor *src;  // cursor over the source of v
+};
 
-   lval *syms = a->cell[0];
-   for (int i = 0; i < syms->count; i++)
-      LASSERT(a, syms->cell[i]->type == LVAL_SYM,
-         "Function 'def' cannot define non-symbol. "
-         "Got %s, expected %s.",
-         ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+lcursor *lcursor_open(lval *v) {
+   lcursor *c = lmem_alloc(sizeof(lcursor));
+   c->v = lval_ref(v);
+   c->i = v->type == LVAL_SEQ && v->seq->kind == LSEQ_RANGE
+      ? v->seq->from : 0;
+   c->exact = v->type == LVAL_SEQ && v->seq->kind == LSEQ_RANGE
+      && c->i == floor(c->i) && v->seq->step == floor(v->seq->step);
+   c->cur = NULL;
+   c->file = NULL;
+   c->src = NULL;
+   if (v->type == LVAL_SEQ && v->seq->src && v->seq->kind != LSEQ_ITERATE)
+      c->src = lcursor_open(v->seq->src);
+   return c;
+}
 
-   LASSERT(a, syms->count == a->count - 1,
-      "Function 'def' cannot define incorrect "
-      "number of values to symbols. "
-      "Got %i, expected %i.",
-      syms->count, a->count - 1);
+void lcursor_close(lcursor *c) {
+   if (c->src)
+      lcursor_close(c->src);
+   if (c->cur)
+      lval_del(c->cur);
+   if (c->file)
+      fclose(c->file);
+   lval_del(c->v);
+   lmem_free(c, sizeof(lcursor));
+}
 
-   for (int i = 0; i < syms->count; i++) {
-      // if 'def' define globally, if 'put' define locally
-      if (strcmp(func, "def") == 0)
-         lenv_def(e, syms->cell[i], a->cell[i+1]);
-      if (strcmp(func, "=") == 0)
-         lenv_put(e, syms->cell[i], a->cell[i+1]);
+// next element of c, NULL once there are none left. an error ends the
+// sequence and is returned in place of the element
+lval *lcursor_next(lenv *e, lcursor *c) {
+   // pulling from a range or a file evaluates nothing, so it counts
+   // as a step of its own
+   if (llimit.active) {
+      lval *err = llimit_step();
+      if (err)
+         return err;
    }
 
-   lval_del(a); 
-   return lval_sym("ok");
-}
-
-lenv *lenv_copy(lenv *e);
+   if (c->v->type == LVAL_QEXPR)
+      return c->i < c->v->count ? lval_ref(c->v->cell[(int)c->i++]) : NULL;
 
-lval *lval_copy(lval *v) {
-   lval *x = malloc(sizeof(lval));
-   x->type = v->type;
+   lseq *s = c->v->seq;
+   lval *x;
+   switch (s->kind) {
+      case LSEQ_RANGE:
+         if (s->step > 0 ? c->i >= s->to : c->i <= s->to)
+            return NULL;
+         x = c->exact && fabs(c->i) < 9007199254740992.0
+            ? lval_int(c->i) : lval_num(c->i);
+         c->i += s->step;
+         return x;
+
+      case LSEQ_ITERATE:
+         x = c->cur
+            ? lval_call(e, s->fn, lval_add(lval_sexpr(), lval_ref(c->cur)))
+            : lval_ref(s->src);
+         if (c->cur)
+            lval_del(c->cur);
+         c->cur = lval_ref(x);
+         return x;
+
+      case LSEQ_LINES: {
+         if (!c->file && c->i == 0) {
+            c->i = 1;
+            c->file = fopen(s->path, "r");
+            if (!c->file)
+               return lval_err_in(lval_ref(c->v),
+                  "Could not read lines of %s", s->path);
+         }
+         if (!c->file)
+            return NULL;
+         char *line = NULL;
+         size_t cap = 0;
+         ssize_t n = getline(&line, &cap, c->file);
+         if (n < 0) {
+            free(line);
+            fclose(c->file);
+            c->file = NULL;
+            return NULL;
+         }
+         if (n > 0 && line[n - 1] == '\n')
+            line[n - 1] = '\0';
+         x = lval_str(line);
+         free(line);
+         return x;
+      }
 
-   switch (v->type) {
-      case LVAL_FUN: 
-         if (v->builtin) {
-            x->builtin = v->builtin; 
-         } else {
-            x->builtin = NULL;
-            x->env = lenv_copy(v->env);
-            x->formals = lval_copy(v->formals);
-            x->body = lval_copy(v->body);
+      case LSEQ_MAP:
+         x = lcursor_next(e, c->src);
+         if (!x || x->type == LVAL_ERR)
+            return x;
+         return lval_call(e, s->fn, lval_add(lval_sexpr(), x));
+
+      case LSEQ_FILTER:
+         while ((x = lcursor_next(e, c->src))) {
+            if (x->type == LVAL_ERR)
+               return x;
+            lval *keep = lval_call(e, s->fn,
+               lval_add(lval_sexpr(), lval_ref(x)));
+            if (keep->type != LVAL_NUM) {
+               lval *err = keep->type == LVAL_ERR ? lval_ref(keep)
+                  : lval_err("Function 'filter' predicate returned %s, "
+                     "expected %s.", ltype_name(keep->type),
+                     ltype_name(LVAL_NUM));
+               lval_del(keep);
+               lval_del(x);
+               return err;
+            }
+            bool kept = keep->num != 0;
+            lval_del(keep);
+            if (kept)
+               return x;
+            lval_del(x);
          }
-      break;
+         return NULL;
+
+      case LSEQ_TAKE:
+         if (c->i >= s->from)
+            return NULL;
+         c->i++;
+         return lcursor_next(e, c->src);
+
+      case LSEQ_DROP:
+         for (; c->i < s->from; c->i++) {
+            x = lcursor_next(e, c->src);
+            if (!x || x->type == LVAL_ERR)
+               return x;
+            lval_del(x);
+         }
+         return lcursor_next(e, c->src);
+   }
+   return NULL;
+}
 
-      case LVAL_NUM: x->num = v->num; break;
+// (range n), (range from to) or (range from to step)
+lval *builtin_range(lenv *e, lval *a) {
+   LASSERT(a, a->count >= 1 && a->count <= 3,
+      "Function 'range' passed incorrect number of arguments. "
+      "Got %i, expected %i to %i.",
+      a->count, 1, 3);
 
-      // copy strings
-      case LVAL_ERR:
-         x->err = malloc(strlen(v->err) + 1);
-         strcpy(x->err, v->err);
-         break;
+   for (int i = 0; i < a->count; i++)
+      LASSERT(a, a->cell[i]->type == LVAL_NUM,
+         "Function 'range' passed incorrect type for argument %i. "
+         "Got %s, expected %s.",
+         i, ltype_name(a->cell[i]->type), ltype_name(LVAL_NUM));
 
-      case LVAL_SYM:
-         x->sym = malloc(strlen(v->sym) + 1);
-         strcpy(x->sym, v->sym);
-         break;
-      
-      case LVAL_STR:
-         x->str = malloc(strlen(v->str) + 1);
-         strcpy(x->str, v->str);
-         break;
+   lval *v = lval_seq(LSEQ_RANGE);
+   v->seq->from = a->count > 1 ? a->cell[0]->num : 0;
+   v->seq->to = a->count > 1 ? a->cell[1]->num : a->cell[0]->num;
+   v->seq->step = a->count > 2 ? a->cell[2]->num : 1;
+   lval_del(a);
 
-      // copy lists
-      case LVAL_SEXPR:
-      case LVAL_QEXPR:
-         x->count = v->count;
-         x->cell = malloc(sizeof(lval*) * x->count);
-         for (int i = 0; i < x->count; i++)
-            x->cell[i] = lval_copy(v->cell[i]);
-         break;
+   if (v->seq->step == 0) {
+      lval_del(v);
+      return lval_err("Function 'range' passed a step of 0!");
    }
-   return x;
+   return v;
 }
 
-lenv *lenv_copy(lenv *e) {
-   lenv *n = malloc(sizeof(lenv));
-   n->count = e->count;
-   n->par = e->par;
-   n->syms = malloc(sizeof(char*) * n->count);
-   n->vals = malloc(sizeof(lval*) * n->count);
-   for (int i = 0; i < e->count; i++) {
-      n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-      strcpy(n->syms[i], e->syms[i]);
-      n->vals[i] = lval_copy(e->vals[i]);
-   }
-   return n;
+// (iterate f x), the endless sequence x, (f x), (f (f x)) ...
+lval *builtin_iterate(lenv *e, lval *a) {
+   LASSERT(a, a->count == 2,
+      "Function 'iterate' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 2);
 
+   LASSERT(a, a->cell[0]->type == LVAL_FUN,
+      "Function 'iterate' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_FUN));
+
+   lval *v = lval_seq(LSEQ_ITERATE);
+   v->seq->fn = lval_pop(a, 0);
+   v->seq->src = lval_take(a, 0);
+   return v;
 }
 
-// get lval from the environment 
-lval *lenv_get(lenv *e, lval *k) {
-   for (int i = 0; i < e->count; i++)
-      if (strcmp(e->syms[i], k->sym) == 0)
-         return lval_copy(e->vals[i]);
+// lines of a file as strings, the file is read as they are pulled
+lval *builtin_lines(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'lines' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
 
-   if (e->par)
-      return lenv_get(e->par, k);
-   else
-      return lval_err("Unbound Symbol '%s'", k->sym);
+   LASSERT(a, a->cell[0]->type == LVAL_STR,
+      "Function 'lines' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+   lval *v = lval_seq(LSEQ_LINES);
+   v->seq->path = lstr_new(a->cell[0]->str);
+   lval_del(a);
+   return v;
 }
 
-// put symbol k as lval v into the LOCAL environment e
-void lenv_put(lenv *e, lval *k, lval *v) {
-   for (int i = 0; i < e->count; i++) {
-      if (strcmp(e->syms[i], k->sym) == 0) {
-         lval_del(e->vals[i]);
-         e->vals[i] = lval_copy(v);
-         return;
-      }
+// map, filter, take and drop: a function or count, then a sequence
+lval *builtin_wrap(lenv *e, lval *a, char *func, int kind) {
+   bool counted = kind == LSEQ_TAKE || kind == LSEQ_DROP;
+
+   LASSERT(a, a->count == 2,
+      "Function '%s' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      func, a->count, 2);
+
+   int type = counted ? LVAL_NUM : LVAL_FUN;
+   LASSERT(a, a->cell[0]->type == type,
+      "Function '%s' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      func, ltype_name(a->cell[0]->type), ltype_name(type));
+
+   LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+      "Function '%s' passed incorrect type for argument 1. "
+      "Got %s, expected %s.",
+      func, ltype_name(a->cell[1]->type), ltype_name(LVAL_SEQ));
+
+   if (counted) {
+      double n = a->cell[0]->num;
+      LASSERT(a, n >= 0 && n == floor(n),
+         "Function '%s' passed a count of %g, "
+         "expected a non-negative integer.", func, n);
    }
 
-   e->count++;
-   e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-   e->syms = realloc(e->syms, sizeof(char*) * e->count);
+   lval *v = lval_seq(kind);
+   if (counted) {
+      v->seq->from = a->cell[0]->num;
+      lval_del(lval_pop(a, 0));
+   } else {
+      v->seq->fn = lval_pop(a, 0);
+   }
+   v->seq->src = lval_take(a, 0);
+   return v;
+}
 
-   e->vals[e->count - 1] = lval_copy(v);
-   e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-   strcpy(e->syms[e->count - 1], k->sym);
+lval *builtin_map(lenv *e, lval *a) {
+   return builtin_wrap(e, a, "map", LSEQ_MAP);
 }
 
-// put symbol k as lval v into the GLOBAL environment of e 
-void lenv_def(lenv *e, lval *k, lval *v) {
-   // iterate to outermost environment
-   while (e->par)
-      e = e->par;
+lval *builtin_filter(lenv *e, lval *a) {
+   return builtin_wrap(e, a, "filter", LSEQ_FILTER);
+}
 
-   lenv_put(e, k, v);
+lval *builtin_take(lenv *e, lval *a) {
+   return builtin_wrap(e, a, "take", LSEQ_TAKE);
 }
 
-// add builtin func to the environment e as name
-void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
-   lval *k = lval_sym(name); 
-   lval *v = lval_fun(func);
-   lenv_put(e, k, v);
-   lval_del(k);
-   lval_del(v);
+lval *builtin_drop(lenv *e, lval *a) {
+   return builtin_wrap(e, a, "drop", LSEQ_DROP);
 }
 
-lval *builtin_eval(lenv *e, lval *a);
+// (reduce f z s) folds the elements of s into z like foldl, holding
+// only one element at a time
+lval *builtin_reduce(lenv *e, lval *a) {
+   LASSERT(a, a->count == 3,
+      "Function 'reduce' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 3);
 
-lval *lval_call(lenv *e, lval *f, lval* a) {
-   if (f->builtin)
-      return f->builtin(e, a);
+   LASSERT(a, a->cell[0]->type == LVAL_FUN,
+      "Function 'reduce' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_FUN));
 
-   int given = a->count;
-   int total = f->formals->count;
-   while (a->count) {
-      if (f->formals->count == 0) {
-         lval_del(a);
-         return lval_err("Function passed too many arguments. "
-            "Got %i, expected %i.", given, total);
-      }
-      lval *sym = lval_pop(f->formals, 0);
-      if (strcmp(sym->sym, "&") == 0) {
-         if (f->formals->count != 1) {
-            lval_del(a);
-            return lval_err("Function format invalid. "
-               "Symbol '&' not followed by single symbol.");
-         }
-         lval *nsym = lval_pop(f->formals, 0); 
-         lenv_put(f->env, nsym, builtin_list(e, a));
-         lval_del(sym);
-         lval_del(nsym);
+   LASSERT(a, a->cell[2]->type == LVAL_SEQ || a->cell[2]->type == LVAL_QEXPR,
+      "Function 'reduce' passed incorrect type for argument 2. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[2]->type), ltype_name(LVAL_SEQ));
+
+   lval *f = lval_pop(a, 0);
+   lval *acc = lval_pop(a, 0);
+   lcursor *c = lcursor_open(a->cell[0]);
+   lval_del(a);
+
+   lval *x;
+   while (acc->type != LVAL_ERR && (x = lcursor_next(e, c))) {
+      if (x->type == LVAL_ERR) {
+         lval_del(acc);
+         acc = x;
          break;
       }
-      lval *val = lval_pop(a, 0);
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
+      lval *args = lval_add(lval_add(lval_sexpr(), acc), x);
+      acc = lval_call(e, f, args);
    }
 
-   lval_del(a);
-   if (f->formals->count > 0 && 
-      strcmp(f->formals->cell[0]->sym, "&") == 0) {
-      
-      if (f->formals->count != 2)
-         return lval_err("Function format invalid. "
-            "Symbol '&' not folloewd by single symbol.");
+   lcursor_close(c);
+   lval_del(f);
+   return acc;
+}
 
-      lval_del(lval_pop(f->formals, 0));
-      lval *sym = lval_pop(f->formals, 0);
-      lval *val = lval_qexpr();
+// every element of a sequence in a Q-Expression
+lval *builtin_collect(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'collect' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
 
-      lenv_put(f->env, sym, val);
-      lval_del(sym);
-      lval_del(val);
+   LASSERT(a, a->cell[0]->type == LVAL_SEQ || a->cell[0]->type == LVAL_QEXPR,
+      "Function 'collect' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_SEQ));
+
+   if (a->cell[0]->type == LVAL_QEXPR)
+      return lval_take(a, 0);
+
+   lcursor *c = lcursor_open(a->cell[0]);
+   lval_del(a);
+
+   lval *v = lval_qexpr();
+   lval *x;
+   while ((x = lcursor_next(e, c))) {
+      if (x->type == LVAL_ERR) {
+         lval_del(v);
+         v = x;
+         break;
+      }
+      v = lval_add(v, x);
    }
 
-   if (f->formals->count == 0) {
-      f->env->par = e;
-      return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
-   } 
-   else
-      return lval_copy(f);
+   lcursor_close(c);
+   return v;
 }
 
-void lenv_add_builtins(lenv *e) {
-   // list functions
-   lenv_add_builtin(e, "list", builtin_list);
-   lenv_add_builtin(e, "head", builtin_head);
-   lenv_add_builtin(e, "tail", builtin_tail);
-   lenv_add_builtin(e, "eval", builtin_eval);
-   lenv_add_builtin(e, "join", builtin_join);
-   lenv_add_builtin(e, "cons", builtin_cons);
-   lenv_add_builtin(e, "len", builtin_len);
-   lenv_add_builtin(e, "init", builtin_init);
-   lenv_add_builtin(e, "read", builtin_read);
+// loops evaluate a body, a Q-Expression, over and over in one frame
+// holding their variables, which are rebound in place. an iteration
+// allocates nothing beyond what the body itself does
 
-   // math functions
-   lenv_add_builtin(e, "+", builtin_add);
-   lenv_add_builtin(e, "-", builtin_sub);
-   lenv_add_builtin(e, "*", builtin_mul);
-   lenv_add_builtin(e, "/", builtin_div);
-   lenv_add_builtin(e, "%", builtin_mod);
-   lenv_add_builtin(e, "^", builtin_pow);
+// a loop in progress. recur leaves the values of the next iteration
+// with the innermost one and returns its marker, an error that
+// unwinds the body back to the loop like any other would
+typedef struct lloop lloop;
 
-   // variable functions
-   lenv_add_builtin(e, "def", builtin_def);
-   lenv_add_builtin(e, "=", builtin_put);
-   lenv_add_builtin(e, "env", builtin_env);
-   lenv_add_builtin(e, "\\", builtin_lambda);
-
-   lenv_add_var(e, "pi", acos(-1));
-   lenv_add_var(e, "e", exp(1));
-   lenv_add_var(e, "true", true);
-   lenv_add_var(e, "false", false);
-
-   lenv_add_builtin(e, "exit", builtin_exit);
-   lenv_add_builtin(e, "fun", builtin_fun);
-
-   lenv_add_builtin(e, "if", builtin_if);
-   lenv_add_builtin(e, "==", builtin_eq);
-   lenv_add_builtin(e, "!=", builtin_ne);
-   lenv_add_builtin(e, ">", builtin_gt);
-   lenv_add_builtin(e, "<", builtin_lt);
-   lenv_add_builtin(e, ">=", builtin_ge);
-   lenv_add_builtin(e, "<=", builtin_le);
-   
-   lenv_add_builtin(e, "!", builtin_not);
-   lenv_add_builtin(e, "||", builtin_or);
-   lenv_add_builtin(e, "&&", builtin_and);
+struct lloop {
+   lval *marker;
+   lval **next;   // values given to recur, NULL until it is called
+   int count;     // variables the loop binds
+   lloop *up;     // loop this one runs in
+};
+
+lloop *lloop_cur;
 
-   lenv_add_builtin(e, "load", builtin_load);
-   lenv_add_builtin(e, "error", builtin_error);
-   lenv_add_builtin(e, "print", builtin_print);
+// recur only goes around its loop from the tail of the body. its
+// marker anywhere else, as an argument or the result of a builtin
+// other than if or eval, would silently drop whatever was left to do
+lval *lloop_misplaced(lval *x) {
+   if (!lloop_cur || x != lloop_cur->marker)
+      return x;
+   lval_del(x);
+   return lval_err("Function 'recur' used outside of the tail of its loop.");
 }
 
-void lenv_print(lenv *e) {
-   for (int i = 0; i < e->count; i++) {
-      printf("%s: ", e->syms[i]);
-      lval_println(e->vals[i]);
+// check that argument i of a, naming the variables of a loop, holds
+// n symbols, or any number of them if n is negative
+lval *lloop_check_vars(lval *a, int i, int n, char *func) {
+   lval *vars = a->cell[i];
+   if (vars->type != LVAL_QEXPR)
+      return lval_err("Function '%s' passed incorrect type for argument %i. "
+         "Got %s, expected %s.",
+         func, i, ltype_name(vars->type), ltype_name(LVAL_QEXPR));
+   for (int j = 0; j < vars->count; j++)
+      if (vars->cell[j]->type != LVAL_SYM)
+         return lval_err("Function '%s' cannot bind non-symbol. "
+            "Got %s, expected %s.",
+            func, ltype_name(vars->cell[j]->type), ltype_name(LVAL_SYM));
+   if (n >= 0 && vars->count != n)
+      return lval_err("Function '%s' passed incorrect number of symbols. "
+         "Got %i, expected %i.", func, vars->count, n);
+   return NULL;
+}
+
+// frame for the variables in vars, the body of a loop runs in it
+lenv *lloop_frame(lenv *e, lval *vars) {
+   lenv *f = lenv_new();
+   f->par = e;
+   for (int i = 0; i < vars->count; i++) {
+      if (!f->shadows && lfold_watched(vars->cell[i]->sym)) {
+         f->shadows = true;
+         lfold.shadow++;
+      }
    }
+   return f;
 }
 
+// evaluate the body of a loop once in f
+lval *lloop_body(lenv *f, lval *body) {
+   if (body->epoch != lfold.epoch)
+      lval_fold(f, body);
+   return lval_eval_sexpr(f, lval_ref(body));
+}
 
-lval *builtin_eval(lenv *e, lval *a) {
-   LASSERT(a, a->count == 1, 
-      "Funciton 'eval' passed too many arugments. "
-      "Got %s, expected %s.",
-      a->count, 1);
+// (loop {vars} values... {body}), evaluate body with vars bound to
+// values. where body calls (recur values...) it starts over with vars
+// bound to those instead, otherwise its value is that of the loop
+lval *builtin_loop(lenv *e, lval *a) {
+   LASSERT(a, a->count >= 2,
+      "Function 'loop' passed too few arguments. "
+      "Got %i, expected at least %i.",
+      a->count, 2);
+   lval *err = lloop_check_vars(a, 0, a->count - 2, "loop");
+   if (err) {
+      lval_del(a);
+      return err;
+   }
 
-   LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
-      "Function 'eval' passed incorrect type for argument 0. "
+   lval *body = a->cell[a->count - 1];
+   LASSERT(a, body->type == LVAL_QEXPR,
+      "Function 'loop' passed incorrect type for argument %i. "
       "Got %s, expected %s.",
-      ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+      a->count - 1, ltype_name(body->type), ltype_name(LVAL_QEXPR));
+
+   lval *vars = a->cell[0];
+   lenv *f = lloop_frame(e, vars);
+   for (int i = 0; i < vars->count; i++)
+      lenv_put(f, vars->cell[i], a->cell[i + 1]);
+
+   // the marker is not an error anything raised, so it is not traced
+   lloop l;
+   bool traced = ltrace.on;
+   ltrace.on = false;
+   l.marker = lval_err("Function 'recur' used outside of its loop.");
+   ltrace.on = traced;
+   l.next = lmem_alloc(sizeof(lval*) * vars->count);
+   l.count = vars->count;
+   l.up = lloop_cur;
+   for (int i = 0; i < l.count; i++)
+      l.next[i] = NULL;
+   lloop_cur = &l;
+
+   lval *x;
+   while ((x = lloop_body(f, body)) == l.marker) {
+      lval_del(x);
+      for (int i = 0; i < l.count; i++) {
+         lenv_put(f, vars->cell[i], l.next[i]);
+         lval_del(l.next[i]);
+         l.next[i] = NULL;
+      }
+   }
 
-   lval *x = lval_take(a, 0);
-   x->type = LVAL_SEXPR;
-   return lval_eval(e, x);
+   lloop_cur = l.up;
+   for (int i = 0; i < l.count; i++)
+      if (l.next[i])
+         lval_del(l.next[i]);
+   lmem_free(l.next, sizeof(lval*) * l.count);
+   lval_del(l.marker);
+   lenv_del(f);
+   lval_del(a);
+   return x;
 }
 
-void lval_function_print(lbuiltin f) {
-   if (f == builtin_add)  printf("<function '+'>");
-   if (f == builtin_sub)  printf("<function '-'>");
-   if (f == builtin_mul)  printf("<function '*'>");
-   if (f == builtin_div)  printf("<function '/'>");
-   if (f == builtin_mod)  printf("<function '%%'>");
-   if (f == builtin_pow)  printf("<function '^'>");
-
-   if (f == builtin_list)  printf("<function 'list'>");
-   if (f == builtin_head)  printf("<function 'head'>");
-   if (f == builtin_tail)  printf("<function 'tail'>");
-   if (f == builtin_join)  printf("<function 'join'>");
-   if (f == builtin_cons)  printf("<function 'cons'>");
-   if (f == builtin_len)   printf("<function 'len'>");
-   if (f == builtin_init)  printf("<function 'init'>");
-   if (f == builtin_eval)  printf("<function 'eval'>");
-
-   if (f == builtin_def)      printf("<function 'def'>");
-   if (f == builtin_put)      printf("<function '='>");
-   if (f == builtin_env)      printf("<function 'env'>");
-   if (f == builtin_lambda)   printf("<function 'lambda'>");
-   if (f == builtin_fun)      printf("<function 'fun'>");
-
-   if (f == builtin_exit)  printf("<function 'exit'>");
- 
-   if (f == builtin_if) printf("<function 'if'>");
-   if (f == builtin_eq) printf("<function 'eq'>");
-   if (f == builtin_ne) printf("<function 'ne'>");
-   if (f == builtin_gt) printf("<function 'gt'>");
-   if (f == builtin_lt) printf("<function 'lt'>");
-   if (f == builtin_ge) printf("<function 'ge'>");
-   if (f == builtin_le) printf("<function 'le'>");
+// (recur values...), start the innermost loop over, see builtin_loop
+lval *builtin_recur(lenv *e, lval *a) {
+   LASSERT(a, lloop_cur, "Function 'recur' used outside of a loop.");
 
-   if (f == builtin_not)   printf("<function 'not'>");
-   if (f == builtin_or)    printf("<function 'or'>");
-   if (f == builtin_and)   printf("<function 'and'>");
+   lloop *l = lloop_cur;
+   LASSERT(a, a->count == l->count,
+      "Function 'recur' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, l->count);
 
-   if (f == builtin_load)   printf("<function 'load'>");
-   if (f == builtin_error)   printf("<function 'error'>");
-   if (f == builtin_print)   printf("<function 'print'>");
+   // only the last call before the body unwinds counts
+   for (int i = 0; i < l->count; i++) {
+      if (l->next[i])
+         lval_del(l->next[i]);
+      l->next[i] = lval_ref(a->cell[i]);
+   }
+   lval_del(a);
+   return lval_ref(l->marker);
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v) {
-   // eval children
-   for (int i = 0; i < v->count; i++) 
-      v->cell[i] = lval_eval(e, v->cell[i]); 
+// (while {cond} {body}), evaluate body for as long as cond evaluates
+// to a number other than 0. both are evaluated where while is, so
+// body rebinds variables there with '='. returns the value of body
+// the last time, {} if it never ran
+lval *builtin_while(lenv *e, lval *a) {
+   LASSERT(a, a->count == 2,
+      "Function 'while' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 2);
+
+   for (int i = 0; i < 2; i++)
+      LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+         "Function 'while' passed incorrect type for argument %i. "
+         "Got %s, expected %s.",
+         i, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+
+   lval *x = lval_qexpr();
+   for (;;) {
+      lval *c = lloop_body(e, a->cell[0]);
+      if (c->type == LVAL_ERR) {
+         lval_del(x);
+         x = c;
+         break;
+      }
+      if (c->type != LVAL_NUM) {
+         lval_del(x);
+         x = lval_err(
+            "Function 'while' condition evaluated to %s, expected %s.",
+            ltype_name(c->type), ltype_name(LVAL_NUM));
+         lval_del(c);
+         break;
+      }
+      bool more = c->num != 0;
+      lval_del(c);
+      if (!more)
+         break;
+
+      lval_del(x);
+      x = lloop_body(e, a->cell[1]);
+      if (x->type == LVAL_ERR)
+         break;
+   }
+
+   lval_del(a);
+   return x;
+}
+
+// (dotimes {i} n {body}), evaluate body with i bound to 0, 1, ... for
+// as long as i is below n. returns the value of body the last time,
+// {} if it never ran
+lval *builtin_dotimes(lenv *e, lval *a) {
+   LASSERT(a, a->count == 3,
+      "Function 'dotimes' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 3);
+   lval *err = lloop_check_vars(a, 0, 1, "dotimes");
+   if (err) {
+      lval_del(a);
+      return err;
+   }
+
+   LASSERT(a, a->cell[1]->type == LVAL_NUM,
+      "Function 'dotimes' passed incorrect type for argument 1. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[1]->type), ltype_name(LVAL_NUM));
+
+   LASSERT(a, a->cell[2]->type == LVAL_QEXPR,
+      "Function 'dotimes' passed incorrect type for argument 2. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[2]->type), ltype_name(LVAL_QEXPR));
+
+   lval *var = a->cell[0]->cell[0];
+   lenv *f = lloop_frame(e, a->cell[0]);
+   lval *i = lval_int(0);
+   lenv_put(f, var, i);
+   lval_del(i);
+
+   lval *x = lval_qexpr();
+   double n = a->cell[1]->num;
+   for (long k = 0; k < n; k++) {
+      // the counter is the first binding of the frame. it is changed
+      // in place unless the body held on to it
+      i = f->vals[0];
+      if (i->refs == 1 && i->type == LVAL_NUM) {
+         i->num = k;
+         i->inum = k;
+         i->exact = true;
+      } else {
+         i = lval_int(k);
+         lenv_put(f, var, i);
+         lval_del(i);
+      }
+
+      lval_del(x);
+      x = lloop_body(f, a->cell[2]);
+      if (x->type == LVAL_ERR)
+         break;
+   }
+
+   lenv_del(f);
+   lval_del(a);
+   return x;
+}
+
+// (for-each {x} s {body}), evaluate body with x bound to each element
+// of the sequence or Q-Expression s in turn. returns the value of body
+// the last time, {} if it never ran
+lval *builtin_for_each(lenv *e, lval *a) {
+   LASSERT(a, a->count == 3,
+      "Function 'for-each' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 3);
+   lval *err = lloop_check_vars(a, 0, 1, "for-each");
+   if (err) {
+      lval_del(a);
+      return err;
+   }
+
+   LASSERT(a, a->cell[1]->type == LVAL_SEQ || a->cell[1]->type == LVAL_QEXPR,
+      "Function 'for-each' passed incorrect type for argument 1. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[1]->type), ltype_name(LVAL_SEQ));
+
+   LASSERT(a, a->cell[2]->type == LVAL_QEXPR,
+      "Function 'for-each' passed incorrect type for argument 2. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[2]->type), ltype_name(LVAL_QEXPR));
+
+   lval *var = a->cell[0]->cell[0];
+   lenv *f = lloop_frame(e, a->cell[0]);
+   lcursor *c = lcursor_open(a->cell[1]);
+
+   lval *x = lval_qexpr();
+   lval *y;
+   while ((y = lcursor_next(e, c))) {
+      lval_del(x);
+      if (y->type == LVAL_ERR) {
+         x = y;
+         break;
+      }
+      lenv_put(f, var, y);
+      lval_del(y);
+      x = lloop_body(f, a->cell[2]);
+      if (x->type == LVAL_ERR)
+         break;
+   }
+
+   lcursor_close(c);
+   lenv_del(f);
+   lval_del(a);
+   return x;
+}
+
+lval *builtin_var(lenv *e, lval *a, char *func);
+
+lval *builtin_def(lenv *e, lval *a) {
+   return builtin_var(e, a, "def");
+}
+
+lval *builtin_put(lenv *e, lval *a) {
+   return builtin_var(e, a, "=");
+}
+
+
+lval *builtin_var(lenv *e, lval *a, char *func) {
+   LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+      "Function 'def' passed incorrect type for argument 0. "
+      "Got %s, expected %s",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+   lval *syms = a->cell[0];
+   for (int i = 0; i < syms->count; i++)
+      LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+         "Function 'def' cannot define non-symbol. "
+         "Got %s, expected %s.",
+         ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+
+   LASSERT(a, syms->count == a->count - 1,
+      "Function 'def' cannot define incorrect "
+      "number of values to symbols. "
+      "Got %i, expected %i.",
+      syms->count, a->count - 1);
+
+   for (int i = 0; i < syms->count; i++) {
+      // if 'def' define globally, if 'put' define locally
+      if (strcmp(func, "def") == 0)
+         lenv_def(e, syms->cell[i], a->cell[i+1]);
+      if (strcmp(func, "=") == 0) {
+         // locally a builtin or constant is only shadowed for as long
+         // as the environment lives
+         if (lfold_watched(syms->cell[i]->sym)) {
+            if (!e->par) {
+               lfold.epoch++;
+            } else if (!e->shadows) {
+               e->shadows = true;
+               lfold.shadow++;
+            }
+         }
+         lenv_put(e, syms->cell[i], a->cell[i+1]);
+      }
+   }
+
+   lval_del(a); 
+   return lval_sym("ok");
+}
+
+lenv *lenv_copy(lenv *e);
+
+// shallow copy, whatever v refers to is shared with the copy
+lval *lval_copy(lval *v) {
+   lval *x = lval_alloc(v->type);
+
+   switch (v->type) {
+      case LVAL_FUN: 
+         if (v->builtin) {
+            x->builtin = v->builtin; 
+         } else if (v->partial) {
+            x->builtin = NULL;
+            x->partial = lval_ref(v->partial);
+            x->args = lval_ref(v->args);
+            x->shadows = v->shadows;
+            x->arity = v->arity;
+            x->variadic = v->variadic;
+         } else {
+            x->builtin = NULL;
+            x->partial = NULL;
+            x->env = lenv_copy(v->env);
+            x->formals = lval_ref(v->formals);
+            x->body = lval_ref(v->body);
+            x->shadows = v->shadows;
+            x->arity = v->arity;
+            x->variadic = v->variadic;
+            x->calls = 0;
+            x->jit = NULL;
+         }
+      break;
+
+      case LVAL_NUM:
+         x->num = v->num;
+         x->inum = v->inum;
+         x->exact = v->exact;
+         break;
+      case LVAL_SEQ: x->seq = v->seq; x->seq->refs++; break;
+      case LVAL_CHAN: x->chan = v->chan; x->chan->refs++; break;
+
+      // copy strings
+      case LVAL_ERR:
+         x->err = lmem_alloc(sizeof(lerr));
+         *x->err = *v->err;
+         if (v->err->text)
+            x->err->text = lstr_new(v->err->text);
+         if (v->err->held)
+            lval_ref(v->err->held);
+         break;
+      case LVAL_SYM: x->sym = lstr_new(v->sym); break;
+      case LVAL_STR: x->str = lstr_new(v->str); break;
+
+      // lists share their storage, cells are copied on write
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+         x->count = v->count;
+         x->cell = v->cell;
+         x->store = v->store;
+         if (x->store)
+            x->store->refs++;
+         break;
+   }
+   return x;
+}
+
+// return v ready to be mutated, copying it if it is shared
+lval *lval_own(lval *v) {
+   if (v->refs == 1) {
+      // whatever was folded from v stops holding once it changes
+      if (v->fold) {
+         lval_del(v->fold);
+         v->fold = NULL;
+      }
+      v->epoch = 0;
+      return v;
+   }
+   lval *x = lval_copy(v);
+   lval_del(v);
+   return x;
+}
+
+lenv *lenv_copy(lenv *e) {
+   lenv *n = lmem_alloc(sizeof(lenv));
+   n->count = e->count;
+   n->par = e->par;
+   n->syms = n->count ? lmem_alloc(sizeof(char*) * n->count) : NULL;
+   n->vals = n->count ? lmem_alloc(sizeof(lval*) * n->count) : NULL;
+   n->shadows = e->shadows;
+   if (n->shadows)
+      lfold.shadow++;
+   for (int i = 0; i < e->count; i++) {
+      n->syms[i] = lstr_new(e->syms[i]);
+      n->vals[i] = lval_ref(e->vals[i]);
+   }
+   return n;
+
+}
+
+// get lval from the environment 
+lval *lenv_get(lenv *e, lval *k) {
+   for (int i = 0; i < e->count; i++)
+      if (strcmp(e->syms[i], k->sym) == 0)
+         return lval_ref(e->vals[i]);
+
+   if (e->par)
+      return lenv_get(e->par, k);
+   else
+      return lval_err_in(lval_ref(k), "Unbound Symbol '%s'", k->sym);
+}
+
+// put symbol k as lval v into the LOCAL environment e
+void lenv_put(lenv *e, lval *k, lval *v) {
+   for (int i = 0; i < e->count; i++) {
+      if (strcmp(e->syms[i], k->sym) == 0) {
+         lval *old = e->vals[i];
+         e->vals[i] = lval_ref(v);
+         lval_del(old);
+         return;
+      }
+   }
+
+   e->count++;
+   e->vals = lmem_realloc(e->vals, sizeof(lval*) * (e->count - 1),
+      sizeof(lval*) * e->count);
+   e->syms = lmem_realloc(e->syms, sizeof(char*) * (e->count - 1),
+      sizeof(char*) * e->count);
+
+   e->vals[e->count - 1] = lval_ref(v);
+   e->syms[e->count - 1] = lstr_new(k->sym);
+}
+
+// put symbol k as lval v into the GLOBAL environment of e 
+void lenv_def(lenv *e, lval *k, lval *v) {
+   // iterate to outermost environment
+   while (e->par)
+      e = e->par;
+
+   // rebinding a builtin or a constant invalidates everything folded
+   if (lfold_watched(k->sym))
+      lfold.epoch++;
+   lenv_put(e, k, v);
+}
+
+// add builtin func to the environment e as name
+void lenv_add_builtin(lenv *e, char *name, lbuiltin func) {
+   lval *k = lval_sym(name); 
+   lval *v = lval_fun(func);
+   lenv_put(e, k, v);
+   lval_del(k);
+   lval_del(v);
+}
+
+// the template jit compiles hot lambdas to x86-64 code with --jit. it
+// takes lambdas whose body only does exact integer arithmetic and
+// comparisons of its formals and literals, 'if' and calls of itself.
+// the code works on longs. a call whose arguments are not all exact
+// integers stays in the interpreter, one that overflows or runs out of
+// stack deoptimizes: the code gives up and the interpreter runs the
+// call again from the start, which is safe since the code has no side
+// effects
+#if defined(__x86_64__) && defined(__linux__)
+#define LJIT_NATIVE 1
+#endif
+
+// calls of a lambda before it is compiled
+#ifndef LJIT_HOT
+#define LJIT_HOT 64
+#endif
+
+struct ljit {
+   unsigned char *code;  // code mapped by the jit, NULL if none
+   size_t size;
+   long (*entry)(long *argv); // NULL if the lambda can't compile
+   char *self;           // name the lambda calls itself by, or NULL,
+                         // it points into the body
+   unsigned epoch;       // fold epoch the builtins were resolved in
+   char *uses;           // builtins the code of a module assumes, by
+                         // name, NULL for code the jit compiled
+   long (*native)(long *argv); // the module's code, kept across epochs
+};
+
+struct {
+   bool on;
+   char *limit;      // compiled code deoptimizes below this stack address
+   sigjmp_buf fail;
+   long compiled;
+   long deopts;
+} ljit_state;
+
+// code being generated
+typedef struct {
+   unsigned char *buf;
+   size_t len, cap;
+   lval *fn;
+   lenv *root;
+   size_t fail;      // offset of the deoptimization stub
+   size_t start;     // offset of the function proper
+   char *self;       // name the function calls itself by
+   bool ok;
+} lasm;
+
+void lasm_bytes(lasm *a, int n, ...) {
+   if (a->len + n > a->cap) {
+      a->cap = a->cap * 2 + n;
+      a->buf = realloc(a->buf, a->cap);
+   }
+   va_list va;
+   va_start(va, n);
+   for (int i = 0; i < n; i++)
+      a->buf[a->len++] = va_arg(va, int);
+   va_end(va);
+}
+
+void lasm_u32(lasm *a, unsigned x) {
+   lasm_bytes(a, 4, x & 0xff, x >> 8 & 0xff, x >> 16 & 0xff, x >> 24);
+}
+
+void lasm_u64(lasm *a, unsigned long x) {
+   lasm_u32(a, x);
+   lasm_u32(a, x >> 32);
+}
+
+// rel32 of a jump or call ending here to target
+void lasm_rel(lasm *a, size_t target) {
+   lasm_u32(a, (unsigned)(target - (a->len + 4)));
+}
+
+// patch the rel32 at offset at to jump here
+void lasm_patch(lasm *a, size_t at) {
+   unsigned x = a->len - (at + 4);
+   for (int i = 0; i < 4; i++)
+      a->buf[at + i] = x >> (8 * i) & 0xff;
+}
+
+// jo fail
+void lasm_jo_fail(lasm *a) {
+   lasm_bytes(a, 2, 0x0f, 0x80);
+   lasm_rel(a, a->fail);
+}
+
+lval *lasm_resolve(lasm *a, char *sym) {
+   for (int i = 0; i < a->root->count; i++)
+      if (strcmp(a->root->syms[i], sym) == 0)
+         return a->root->vals[i];
+   return NULL;
+}
+
+void lasm_form(lasm *a, lval **cell, int count);
+
+// code leaving the value of v in rax
+void lasm_expr(lasm *a, lval *v) {
+   if (v->type == LVAL_NUM && v->exact) {
+      // mov rax, imm64
+      lasm_bytes(a, 2, 0x48, 0xb8);
+      lasm_u64(a, v->inum);
+      return;
+   }
+
+   if (v->type == LVAL_SYM) {
+      lval *formals = a->fn->formals;
+      for (int i = 0; i < formals->count; i++) {
+         if (strcmp(formals->cell[i]->sym, v->sym) == 0) {
+            // arguments are pushed in order, above the return address
+            // and the saved rbp. mov rax, [rbp + disp32]
+            lasm_bytes(a, 3, 0x48, 0x8b, 0x85);
+            lasm_u32(a, 16 + 8 * (formals->count - 1 - i));
+            return;
+         }
+      }
+      a->ok = false;
+      return;
+   }
+
+   if (v->type == LVAL_SEXPR) {
+      lasm_form(a, v->cell, v->count);
+      return;
+   }
+   a->ok = false;
+}
+
+// code evaluating an S-Expression of the given cells into rax
+void lasm_form(lasm *a, lval **cell, int count) {
+   if (count == 1) {
+      lasm_expr(a, cell[0]);
+      return;
+   }
+   if (count == 0 || cell[0]->type != LVAL_SYM) {
+      a->ok = false;
+      return;
+   }
+
+   // formals never name a function the code could call
+   for (int i = 0; i < a->fn->formals->count; i++)
+      if (strcmp(a->fn->formals->cell[i]->sym, cell[0]->sym) == 0) {
+         a->ok = false;
+         return;
+      }
+
+   lval *f = lasm_resolve(a, cell[0]->sym);
+   int n = count - 1;
+   lval **args = cell + 1;
+   if (!f || f->type != LVAL_FUN) {
+      a->ok = false;
+      return;
+   }
+
+   if (f == a->fn) {
+      // the call is checked to still mean fn at entry, see ljit_call
+      if (n != a->fn->arity || (a->self && strcmp(a->self, cell[0]->sym))) {
+         a->ok = false;
+         return;
+      }
+      a->self = cell[0]->sym;
+      for (int i = 0; i < n; i++) {
+         lasm_expr(a, args[i]);
+         lasm_bytes(a, 1, 0x50);                // push rax
+      }
+      lasm_bytes(a, 1, 0xe8);                   // call start
+      lasm_rel(a, a->start);
+      lasm_bytes(a, 3, 0x48, 0x81, 0xc4);       // add rsp, imm32
+      lasm_u32(a, 8 * n);
+      return;
+   }
+
+   lbuiltin b = f->builtin;
+   if (b == builtin_if) {
+      if (n != 3 || args[1]->type != LVAL_QEXPR
+         || args[2]->type != LVAL_QEXPR) {
+         a->ok = false;
+         return;
+      }
+      lasm_expr(a, args[0]);
+      lasm_bytes(a, 5, 0x48, 0x85, 0xc0, 0x0f, 0x84); // test rax, rax; jz
+      size_t to_else = a->len;
+      lasm_u32(a, 0);
+      lasm_form(a, args[1]->cell, args[1]->count);
+      lasm_bytes(a, 1, 0xe9);                   // jmp
+      size_t to_end = a->len;
+      lasm_u32(a, 0);
+      lasm_patch(a, to_else);
+      lasm_form(a, args[2]->cell, args[2]->count);
+      lasm_patch(a, to_end);
+      return;
+   }
+
+   // setcc of each comparison
+   int cc = b == builtin_lt ? 0x9c : b == builtin_gt ? 0x9f
+      : b == builtin_le ? 0x9e : b == builtin_ge ? 0x9d
+      : b == builtin_eq ? 0x94 : b == builtin_ne ? 0x95 : 0;
+   bool arith = b == builtin_add || b == builtin_sub || b == builtin_mul;
+   if (cc ? n != 2 : !arith || n < 1) {
+      a->ok = false;
+      return;
+   }
+
+   lasm_expr(a, args[0]);
+   if (b == builtin_sub && n == 1) {
+      lasm_bytes(a, 3, 0x48, 0xf7, 0xd8);       // neg rax
+      lasm_jo_fail(a);
+      return;
+   }
+   for (int i = 1; i < n; i++) {
+      lasm_bytes(a, 1, 0x50);                   // push rax
+      lasm_expr(a, args[i]);
+      lasm_bytes(a, 4, 0x48, 0x89, 0xc1, 0x58); // mov rcx, rax; pop rax
+      if (cc) {
+         // cmp rax, rcx; setcc al; movzx eax, al
+         lasm_bytes(a, 9, 0x48, 0x39, 0xc8, 0x0f, cc, 0xc0, 0x0f, 0xb6, 0xc0);
+         continue;
+      }
+      if (b == builtin_add)
+         lasm_bytes(a, 3, 0x48, 0x01, 0xc8);    // add rax, rcx
+      if (b == builtin_sub)
+         lasm_bytes(a, 3, 0x48, 0x29, 0xc8);    // sub rax, rcx
+      if (b == builtin_mul)
+         lasm_bytes(a, 4, 0x48, 0x0f, 0xaf, 0xc1); // imul rax, rcx
+      lasm_jo_fail(a);
+   }
+}
+
+void ljit_deopt() {
+   siglongjmp(ljit_state.fail, 1);
+}
+
+// compile fn, the code field is NULL if it can't be
+ljit *ljit_compile(lenv *e, lval *fn) {
+   ljit *j = lmem_alloc(sizeof(ljit));
+   j->code = NULL;
+   j->entry = NULL;
+   j->self = NULL;
+   j->epoch = lfold.epoch;
+   j->uses = NULL;
+   j->native = NULL;
+
+#ifdef LJIT_NATIVE
+   while (e->par)
+      e = e->par;
+   if (fn->variadic || fn->shadows || fn->arity > 64)
+      return j;
+
+   lasm a = { NULL, 0, 0, fn, e, 0, 0, NULL, true };
+
+   // long entry(long *argv) pushes the arguments and calls the function
+   lasm_bytes(&a, 4, 0x55, 0x48, 0x89, 0xe5);   // push rbp; mov rbp, rsp
+   for (int i = 0; i < fn->arity; i++) {
+      lasm_bytes(&a, 2, 0xff, 0xb7);            // push [rdi + disp32]
+      lasm_u32(&a, 8 * i);
+   }
+   lasm_bytes(&a, 1, 0xe8);                     // call start
+   size_t to_start = a.len;
+   lasm_u32(&a, 0);
+   lasm_bytes(&a, 5, 0x48, 0x89, 0xec, 0x5d, 0xc3); // mov rsp, rbp; pop rbp; ret
+
+   // deoptimization stub, calls ljit_deopt on an aligned stack
+   a.fail = a.len;
+   lasm_bytes(&a, 6, 0x48, 0x83, 0xe4, 0xf0, 0x48, 0xb8); // and rsp, -16; mov rax,
+   lasm_u64(&a, (unsigned long)ljit_deopt);
+   lasm_bytes(&a, 2, 0xff, 0xd0);               // call rax
+
+   // the function, arguments on the stack and the result in rax
+   a.start = a.len;
+   lasm_patch(&a, to_start);
+   lasm_bytes(&a, 4, 0x55, 0x48, 0x89, 0xe5);   // push rbp; mov rbp, rsp
+   lasm_bytes(&a, 2, 0x48, 0xb8);               // mov rax, &limit
+   lasm_u64(&a, (unsigned long)&ljit_state.limit);
+   lasm_bytes(&a, 5, 0x48, 0x3b, 0x20, 0x0f, 0x82); // cmp rsp, [rax]; jb fail
+   lasm_rel(&a, a.fail);
+   lasm_form(&a, fn->body->cell, fn->body->count);
+   lasm_bytes(&a, 2, 0x5d, 0xc3);               // pop rbp; ret
+
+   if (a.ok) {
+      j->self = a.self;
+      j->size = a.len;
+      j->code = mmap(NULL, a.len, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (j->code != MAP_FAILED)
+         memcpy(j->code, a.buf, a.len);
+      // where writable memory can't be made executable, the lambda
+      // stays interpreted
+      if (j->code != MAP_FAILED
+         && mprotect(j->code, a.len, PROT_READ | PROT_EXEC) != 0) {
+         munmap(j->code, a.len);
+         j->code = MAP_FAILED;
+      }
+      if (j->code == MAP_FAILED) {
+         j->code = NULL;
+      } else {
+         j->entry = (long (*)(long *))j->code;
+         ljit_state.compiled++;
+      }
+   }
+   free(a.buf);
+#endif
+   return j;
+}
+
+void ljit_free(ljit *j) {
+   if (j->code)
+      munmap(j->code, j->size);
+   lmem_free(j, sizeof(ljit));
+}
+
+// whether sym means fn when looked up from e
+bool ljit_resolves(lenv *e, char *sym, lval *fn) {
+   for (; e; e = e->par)
+      for (int i = 0; i < e->count; i++)
+         if (strcmp(e->syms[i], sym) == 0)
+            return e->vals[i] == fn;
+   return false;
+}
+
+bool lmodule_resolves(lenv *e, char *uses);
+
+// run a call of fn with arguments a as native code, once it is hot.
+// NULL if the interpreter has to run it, a is then left alone
+lval *ljit_call(lenv *e, lval *fn, lval *a) {
+   if (fn->jit && fn->jit->epoch != lfold.epoch && fn->jit->uses) {
+      // code of a module can't be compiled again, it stays in use while
+      // the builtins it uses are the ones it was translated for
+      ljit *j = fn->jit;
+      j->entry = lmodule_resolves(e, j->uses) ? j->native : NULL;
+      j->epoch = lfold.epoch;
+   } else if (fn->jit && fn->jit->epoch != lfold.epoch) {
+      // a builtin was rebound since, compile again
+      ljit_free(fn->jit);
+      fn->jit = NULL;
+      fn->calls = 0;
+   }
+   if (!fn->jit) {
+      if (!ljit_state.on || ++fn->calls < LJIT_HOT)
+         return NULL;
+      fn->jit = ljit_compile(e, fn);
+   }
+
+   ljit *j = fn->jit;
+   if (!j->entry || lfold.shadow || a->count != fn->arity)
+      return NULL;
+   long argv[64];
+   for (int i = 0; i < a->count; i++) {
+      if (a->cell[i]->type != LVAL_NUM || !a->cell[i]->exact)
+         return NULL;
+      argv[i] = a->cell[i]->inum;
+   }
+   if (j->self && !ljit_resolves(e, j->self, fn))
+      return NULL;
+
+   if (sigsetjmp(ljit_state.fail, 0)) {
+      ljit_state.deopts++;
+      return NULL;
+   }
+   long r = j->entry(argv);
+   lval_del(a);
+   return lval_int(r);
+}
+
+// let native code use the stack from base down to near its limit
+void ljit_stack(void *base) {
+   struct rlimit rl;
+   size_t size = 8 << 20;
+   if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+      size = rl.rlim_cur;
+   ljit_state.limit = (char *)base - size + (256 << 10);
+}
+
+lval *builtin_eval(lenv *e, lval *a);
+
+lval *lval_call(lenv *e, lval *fn, lval* a) {
+   // builtins like reduce call functions without evaluating anything
+   if (llimit.active) {
+      lval *err = llimit_step();
+      if (err) {
+         lval_del(a);
+         return err;
+      }
+   }
+
+   if (fn->builtin) {
+      if (ltrace.on)
+         ltrace_record(LTRACE_ENTER, (uintptr_t)fn->builtin);
+      lval *x = fn->builtin(e, a);
+      if (ltrace.on)
+         ltrace_record(LTRACE_EXIT, (uintptr_t)fn->builtin);
+      if (lloop_cur && fn->builtin != builtin_recur
+         && fn->builtin != builtin_if && fn->builtin != builtin_eval)
+         x = lloop_misplaced(x);
+      return lstack_escape(x);
+   }
+
+   // a partial application passes the arguments it holds first
+   if (fn->partial) {
+      if (!fn->variadic && a->count > fn->arity) {
+         int given = a->count;
+         lval_del(a);
+         return lval_err("Function passed too many arguments. "
+            "Got %i, expected %i.", given, fn->arity);
+      }
+      lval *all = lval_sexpr();
+      for (int i = 0; i < fn->args->count; i++)
+         all = lval_add(all, lval_ref(fn->args->cell[i]));
+      return lval_call(e, fn->partial, lval_join(all, a));
+   }
+
+   int given = a->count;
+   if (!fn->variadic && given > fn->arity) {
+      lval_del(a);
+      return lval_err("Function passed too many arguments. "
+         "Got %i, expected %i.", given, fn->formals->count);
+   }
+   if (fn->variadic && given >= fn->arity
+      && fn->formals->count != fn->arity + 2) {
+      lval_del(a);
+      return lval_err("Function format invalid. "
+         "Symbol '&' not followed by single symbol.");
+   }
+
+   // not every formal is given, hold on to the arguments until the
+   // rest of them are
+   if (given < fn->arity)
+      return lstack_escape(lval_partial(lval_ref(fn), a));
+
+   // the trace knows a lambda by its body, which copies share
+   if (ltrace.on)
+      ltrace_record(LTRACE_ENTER, (uintptr_t)fn->body);
+
+   // compiled by the jit or brought in by a module
+   if ((ljit_state.on || fn->jit) && !llimit.active && !lreference) {
+      lval *x = ljit_call(e, fn, a);
+      if (x) {
+         if (ltrace.on)
+            ltrace_record(LTRACE_EXIT, (uintptr_t)fn->body);
+         return x;
+      }
+   }
+
+   // bind into a private frame, the definition may be shared
+   lval *f = lval_copy(fn);
+   for (int i = 0; i < f->arity; i++) {
+      lval *val = lval_pop(a, 0);
+      lenv_put(f->env, f->formals->cell[i], val);
+      lval_del(val);
+   }
+
+   // whatever is left over becomes the rest list as it is
+   if (f->variadic) {
+      a->type = LVAL_QEXPR;
+      lenv_put(f->env, f->formals->cell[f->arity + 1], a);
+   }
+   lval_del(a);
+
+   // fold the body on the first call and after anything it relied on
+   // was rebound. while the formals shadow a builtin or a constant no
+   // folded value may be used
+   if (f->body->epoch != lfold.epoch)
+      lval_fold(e, f->body);
+   if (llimit.active && llimit.max_depth
+      && llimit.depth >= llimit.max_depth) {
+      llimit.exceeded = LLIMIT_DEPTH;
+      lval_del(f);
+      if (ltrace.on)
+         ltrace_record(LTRACE_EXIT, (uintptr_t)fn->body);
+      return llimit_step();
+   }
+
+   if (f->shadows)
+      lfold.shadow++;
+   // a recur in the body belongs to a loop in the body, not to one
+   // the lambda is called from
+   lloop *loop = lloop_cur;
+   lloop_cur = NULL;
+   llimit.depth++;
+   f->env->par = e;
+   lval *x = lval_eval_sexpr(f->env, lval_ref(f->body));
+   llimit.depth--;
+   lloop_cur = loop;
+   if (f->shadows)
+      lfold.shadow--;
+   lval_del(f);
+   if (ltrace.on)
+      ltrace_record(LTRACE_EXIT, (uintptr_t)fn->body);
+   return lstack_escape(x);
+}
+
+// coroutines. a task makes one function call on a stack of its own and
+// gives way to the others whenever it waits: for a value on a channel,
+// for output of a command or for time to pass. the scheduler runs
+// whichever task can go on next, all on the one thread. the main task
+// is the evaluation that started the program, on the process stack
+#ifndef LTASK_STACK
+#define LTASK_STACK (8 << 20)
+#endif
+
+struct ltask {
+   ucontext_t ctx;
+   char *stack;      // mapping it runs on, NULL for the main task
+   lenv *env;        // global environment the call is made in
+   lval *fn;         // call it makes once it first runs
+   lval *args;
+   lchan *out;       // gets the result of the call
+   lchunk *cur;      // value stack, ljit_state.limit, llimit.depth
+   char *limit;      // and lloop_cur as they were when it was suspended
+   int depth;
+   lloop *loop;
+   int fd;           // descriptor it waits on, -1 if none
+   double deadline;  // when a sleeping task wakes, in ms
+   bool failed;      // woken because nothing could ever wake it
+   lval *got;        // value a sender handed over
+   ltask *next;      // in the ready queue, a channel or the sleepers
+};
+
+struct {
+   ltask main;
+   ltask *cur;
+   ltask *ready;      // tasks that can go on, first in first out
+   ltask *last;
+   ltask *sleeping;   // by deadline
+   int epfd;          // waits on descriptors, created on first use
+   int io;            // tasks waiting on a descriptor
+   ltask *dead;       // finished, its stack is freed by the next task
+   char *stacks;      // stacks of finished tasks, for reuse
+   size_t guard;      // bytes of guard page below each stack
+   long spawned;
+   long switches;
+} lsched = { .main = { .fd = -1 }, .cur = &lsched.main, .epfd = -1 };
+
+void ltask_ready(ltask *t) {
+   t->next = NULL;
+   if (lsched.last)
+      lsched.last->next = t;
+   else
+      lsched.ready = t;
+   lsched.last = t;
+}
+
+// the task to run next, waiting on descriptors and timers until one can
+// go on. NULL when no task is ready and none waits on anything but a
+// channel, so nothing could ever wake one
+ltask *lsched_next() {
+   for (;;) {
+      ltask *t = lsched.ready;
+      if (t) {
+         lsched.ready = t->next;
+         if (!lsched.ready)
+            lsched.last = NULL;
+         return t;
+      }
+      if (!lsched.io && !lsched.sleeping)
+         return NULL;
+
+      int timeout = -1;
+      if (lsched.sleeping) {
+         double ms = lsched.sleeping->deadline - lclock_ms();
+         timeout = ms > 0 ? (int)ceil(ms) : 0;
+      }
+      struct epoll_event ev[16];
+      int n = lsched.io ? epoll_wait(lsched.epfd, ev, 16, timeout)
+         : poll(NULL, 0, timeout);
+      for (int i = 0; i < n && lsched.io; i++) {
+         ltask *w = ev[i].data.ptr;
+         epoll_ctl(lsched.epfd, EPOLL_CTL_DEL, w->fd, NULL);
+         w->fd = -1;
+         lsched.io--;
+         ltask_ready(w);
+      }
+
+      double now = lclock_ms();
+      while (lsched.sleeping && lsched.sleeping->deadline <= now) {
+         ltask *w = lsched.sleeping;
+         lsched.sleeping = w->next;
+         ltask_ready(w);
+      }
+   }
+}
+
+// free the stack of a task that finished, once off it
+void lsched_reap() {
+   ltask *t = lsched.dead;
+   if (!t)
+      return;
+   lsched.dead = NULL;
+   *(char **)(t->stack + lsched.guard) = lsched.stacks;
+   lsched.stacks = t->stack;
+   lmem_free(t, sizeof(ltask));
+}
+
+void ltask_switch(ltask *from, ltask *to) {
+   from->cur = lstack.cur;
+   from->limit = ljit_state.limit;
+   from->depth = llimit.depth;
+   from->loop = lloop_cur;
+   lstack.cur = to->cur;
+   ljit_state.limit = to->limit;
+   llimit.depth = to->depth;
+   lloop_cur = to->loop;
+   lsched.cur = to;
+   lsched.switches++;
+   if (ltrace.on)
+      ltrace_record(LTRACE_TASK, (uintptr_t)to);
+   swapcontext(&from->ctx, &to->ctx);
+   lsched_reap();
+}
+
+// the task that goes on after from stops for good or waits. when none
+// can, the main task is woken with failed set: it is waiting on a
+// channel, as the task running now is not main
+ltask *lsched_after(ltask *from) {
+   ltask *t = lsched_next();
+   if (!t && from != &lsched.main) {
+      t = &lsched.main;
+      t->failed = true;
+   }
+   return t;
+}
+
+// suspend the current task, which is queued wherever it waits, until
+// it is made ready again. false if nothing could ever make it ready
+bool ltask_wait() {
+   ltask *self = lsched.cur;
+   ltask *t = lsched_after(self);
+   if (!t)
+      return false;
+   if (t != self)
+      ltask_switch(self, t);
+   if (self->failed) {
+      self->failed = false;
+      return false;
+   }
+   return true;
+}
+
+// add t to the end of a list of waiting tasks
+void ltask_enqueue(ltask **list, ltask *t) {
+   while (*list)
+      list = &(*list)->next;
+   t->next = NULL;
+   *list = t;
+}
+
+// take t off a list it waited on in vain
+void ltask_dequeue(ltask **list, ltask *t) {
+   while (*list && *list != t)
+      list = &(*list)->next;
+   if (*list)
+      *list = t->next;
+}
+
+void lchan_push(lchan *c, lval *x) {
+   if (c->count == c->cap) {
+      int cap = c->cap ? c->cap * 2 : 8;
+      lval **items = lmem_alloc(sizeof(lval*) * cap);
+      for (int i = 0; i < c->count; i++)
+         items[i] = c->items[(c->head + i) % c->cap];
+      if (c->items)
+         lmem_free(c->items, sizeof(lval*) * c->cap);
+      c->items = items;
+      c->cap = cap;
+      c->head = 0;
+   }
+   c->items[(c->head + c->count++) % c->cap] = x;
+}
+
+// next value queued on c, letting the first waiting sender in
+lval *lchan_pop(lchan *c) {
+   lval *x = c->items[c->head];
+   c->head = (c->head + 1) % c->cap;
+   c->count--;
+   if (c->sending) {
+      ltask *w = c->sending;
+      c->sending = w->next;
+      lchan_push(c, w->got);
+      w->got = NULL;
+      ltask_ready(w);
+   }
+   return x;
+}
+
+// hand x to the first task waiting on c or queue it, false when c is
+// full
+bool lchan_offer(lchan *c, lval *x) {
+   if (c->waiting) {
+      ltask *w = c->waiting;
+      c->waiting = w->next;
+      w->got = x;
+      ltask_ready(w);
+      return true;
+   }
+   if (c->count >= c->bound)
+      return false;
+   lchan_push(c, x);
+   return true;
+}
+
+// no more values, the tasks still waiting wake up empty handed
+void lchan_close(lchan *c) {
+   c->closed = true;
+   while (c->waiting) {
+      ltask *w = c->waiting;
+      c->waiting = w->next;
+      w->got = NULL;
+      ltask_ready(w);
+   }
+}
+
+// first function every task but main runs: make the call, send the
+// result and give way for good
+void ltask_start() {
+   lsched_reap();
+   ltask *t = lsched.cur;
+   lval *x = lval_call(t->env, t->fn, t->args);
+   lval_del(t->fn);
+   if (!lchan_offer(t->out, x))
+      lval_del(x);
+   lchan_close(t->out);
+   lchan_release(t->out);
+
+   // the chunk of the value stack it was using goes with it
+   lchunk *c = lstack.cur;
+   if (c && --c->refs == 0) {
+      c->next = lstack.free;
+      lstack.free = c;
+      lstats.bytes -= sizeof(lchunk);
+   }
+   lstack.cur = NULL;
+
+   lsched.dead = t;
+   ltask_switch(t, lsched_after(t));
+}
+
+// a stack for a new task, with a guard page at the bottom so that
+// running out of it faults rather than corrupting the heap
+char *ltask_stack() {
+   char *s = lsched.stacks;
+   if (s) {
+      lsched.stacks = *(char **)(s + lsched.guard);
+      return s;
+   }
+   lsched.guard = sysconf(_SC_PAGESIZE);
+   s = mmap(NULL, LTASK_STACK, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+   if (s == MAP_FAILED)
+      return NULL;
+   mprotect(s, lsched.guard, PROT_NONE);
+   return s;
+}
+
+// suspend the current task until fd can be read
+void ltask_wait_fd(int fd) {
+   ltask *self = lsched.cur;
+   if (lsched.epfd < 0)
+      lsched.epfd = epoll_create1(EPOLL_CLOEXEC);
+   struct epoll_event ev = { .events = EPOLLIN, .data.ptr = self };
+   if (epoll_ctl(lsched.epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+      return;
+   self->fd = fd;
+   lsched.io++;
+   ltask_wait();
+}
+
+// (spawn f args...), call f with args in a new task. returns a channel
+// that gets the result, await takes it from there
+lval *builtin_spawn(lenv *e, lval *a) {
+   LASSERT(a, a->count >= 1,
+      "Function 'spawn' passed too few arguments. "
+      "Got %i, expected at least %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_FUN,
+      "Function 'spawn' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_FUN));
+
+   char *stack = ltask_stack();
+   LASSERT(a, stack, "Function 'spawn' could not allocate a stack.");
+
+   // the calling frame may be gone by the time the task runs
+   while (e->par)
+      e = e->par;
+
+   ltask *t = lmem_alloc(sizeof(ltask));
+   t->stack = stack;
+   t->env = e;
+   t->fn = lval_pop(a, 0);
+   t->args = lstack_escape(a);
+   lval *c = lval_chan(1);
+   t->out = c->chan;
+   t->out->refs++;
+   t->cur = NULL;
+   t->limit = stack + (256 << 10);
+   t->depth = 0;
+   t->loop = NULL;
+   t->fd = -1;
+   t->failed = false;
+   t->got = NULL;
+
+   getcontext(&t->ctx);
+   t->ctx.uc_stack.ss_sp = stack;
+   t->ctx.uc_stack.ss_size = LTASK_STACK;
+   t->ctx.uc_link = NULL;
+   makecontext(&t->ctx, ltask_start, 0);
+
+   lsched.spawned++;
+   ltask_ready(t);
+   return c;
+}
+
+// (yield x), let every other task that is ready run, then return x
+lval *builtin_yield(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'yield' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   ltask_ready(lsched.cur);
+   ltask_wait();
+   return lval_take(a, 0);
+}
+
+// (chan n), a channel holding up to n values. sending to a full one
+// waits until a value is received
+lval *builtin_chan(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'chan' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_NUM,
+      "Function 'chan' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_NUM));
+
+   double n = a->cell[0]->num;
+   LASSERT(a, n >= 1 && n <= INT_MAX,
+      "Function 'chan' passed a size of %g, expected at least 1.", n);
+
+   lval_del(a);
+   return lval_chan(n);
+}
+
+lval *builtin_send(lenv *e, lval *a) {
+   LASSERT(a, a->count == 2,
+      "Function 'send' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 2);
+
+   LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+      "Function 'send' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_CHAN));
+
+   lchan *c = a->cell[0]->chan;
+   LASSERT(a, !c->closed, "Function 'send' passed a closed channel.");
+   // a channel queued on itself would hold its own last reference
+   LASSERT(a, a->cell[1]->type != LVAL_CHAN || a->cell[1]->chan != c,
+      "Function 'send' cannot send a channel on itself.");
+
+   lval *x = lval_pop(a, 1);
+   if (!lchan_offer(c, x)) {
+      ltask *self = lsched.cur;
+      self->got = x;
+      ltask_enqueue(&c->sending, self);
+      if (!ltask_wait()) {
+         ltask_dequeue(&c->sending, self);
+         self->got = NULL;
+         lval_del(x);
+         LASSERT(a, false,
+            "Function 'send' would wait forever on a full channel.");
+      }
+   }
+
+   lval_del(a);
+   return lval_sym("ok");
+}
+
+// next value on a channel, waiting for one while it is empty
+lval *lchan_recv(lval *a, char *func) {
+   LASSERT(a, a->count == 1,
+      "Function '%s' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      func, a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_CHAN,
+      "Function '%s' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      func, ltype_name(a->cell[0]->type), ltype_name(LVAL_CHAN));
+
+   lchan *c = a->cell[0]->chan;
+   lval *x = NULL;
+   if (c->count) {
+      x = lchan_pop(c);
+   } else if (!c->closed) {
+      ltask *self = lsched.cur;
+      ltask_enqueue(&c->waiting, self);
+      if (!ltask_wait()) {
+         ltask_dequeue(&c->waiting, self);
+         LASSERT(a, false,
+            "Function '%s' would wait forever, "
+            "no task is left to send to the channel.", func);
+      }
+      x = self->got;
+      self->got = NULL;
+   }
+
+   LASSERT(a, x, "Function '%s' passed a closed channel.", func);
+   lval_del(a);
+   return x;
+}
+
+lval *builtin_recv(lenv *e, lval *a) {
+   return lchan_recv(a, "recv");
+}
+
+// result of a task started by spawn
+lval *builtin_await(lenv *e, lval *a) {
+   return lchan_recv(a, "await");
+}
+
+// (sleep ms), let other tasks run for at least ms milliseconds
+lval *builtin_sleep(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'sleep' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_NUM,
+      "Function 'sleep' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_NUM));
+
+   ltask *self = lsched.cur;
+   self->deadline = lclock_ms() + a->cell[0]->num;
+   ltask **p = &lsched.sleeping;
+   while (*p && (*p)->deadline <= self->deadline)
+      p = &(*p)->next;
+   self->next = *p;
+   *p = self;
+   ltask_wait();
+
+   lval_del(a);
+   return lval_sym("ok");
+}
+
+// run gives a script the shell, it is only bound with --allow-run.
+// an image or deserialized value can still hold it, so it checks too
+bool lrun_allowed;
+
+// (run "command"), output of a shell command as a string. other tasks
+// run while it has nothing to read
+lval *builtin_run(lenv *e, lval *a) {
+   LASSERT(a, lrun_allowed,
+      "Function 'run' is only available with --allow-run.");
+
+   LASSERT(a, a->count == 1,
+      "Function 'run' passed incorrect number of arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_STR,
+      "Function 'run' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+   int p[2];
+   LASSERT(a, pipe(p) == 0, "Function 'run' could not create a pipe.");
+   fflush(stdout);
+   pid_t pid = fork();
+   if (pid == 0) {
+      dup2(p[1], STDOUT_FILENO);
+      close(p[0]);
+      close(p[1]);
+      execl("/bin/sh", "sh", "-c", a->cell[0]->str, (char *)NULL);
+      _exit(127);
+   }
+   close(p[1]);
+   if (pid < 0)
+      close(p[0]);
+   LASSERT(a, pid >= 0, "Function 'run' could not start a process.");
+
+   fcntl(p[0], F_SETFL, O_NONBLOCK);
+   size_t len = 0, cap = 4096;
+   char *buf = malloc(cap);
+   for (;;) {
+      if (len + 1 == cap)
+         buf = realloc(buf, cap *= 2);
+      ssize_t n = read(p[0], buf + len, cap - len - 1);
+      if (n > 0)
+         len += n;
+      else if (n < 0 && errno == EAGAIN)
+         ltask_wait_fd(p[0]);
+      else if (n == 0 || errno != EINTR)
+         break;
+   }
+   buf[len] = '\0';
+   close(p[0]);
+   waitpid(pid, NULL, 0);
+
+   lval *x = lval_str(buf);
+   free(buf);
+   lval_del(a);
+   return x;
+}
+
+lval *builtin_serialize(lenv *e, lval *a);
+lval *builtin_deserialize(lenv *e, lval *a);
+
+// every builtin function, images refer to them by their index here
+struct {
+   char *name;    // symbol the function is bound to
+   char *label;   // name it prints as
+   lbuiltin func;
+   bool pure;     // result depends on the arguments alone, may be folded
+} lbuiltins[] = {
+   // list functions
+   { "list", "list", builtin_list, true },
+   { "head", "head", builtin_head, true },
+   { "tail", "tail", builtin_tail, true },
+   { "eval", "eval", builtin_eval, false },
+   { "join", "join", builtin_join, true },
+   { "cons", "cons", builtin_cons, true },
+   { "len", "len", builtin_len, true },
+   { "init", "init", builtin_init, true },
+   { "read", "read", builtin_read, false },
+
+   // math functions
+   { "+", "+", builtin_add, true },
+   { "-", "-", builtin_sub, true },
+   { "*", "*", builtin_mul, true },
+   { "/", "/", builtin_div, true },
+   { "%", "%", builtin_mod, true },
+   { "^", "^", builtin_pow, true },
+
+   // variable functions
+   { "def", "def", builtin_def, false },
+   { "=", "=", builtin_put, false },
+   { "env", "env", builtin_env, false },
+   { "heap", "heap", builtin_heap, false },
+   { "\\", "lambda", builtin_lambda, false },
+
+   { "exit", "exit", builtin_exit, false },
+   { "fun", "fun", builtin_fun, false },
+
+   { "if", "if", builtin_if, false },
+   { "==", "eq", builtin_eq, true },
+   { "!=", "ne", builtin_ne, true },
+   { ">", "gt", builtin_gt, true },
+   { "<", "lt", builtin_lt, true },
+   { ">=", "ge", builtin_ge, true },
+   { "<=", "le", builtin_le, true },
+
+   { "!", "not", builtin_not, true },
+   { "||", "or", builtin_or, true },
+   { "&&", "and", builtin_and, true },
+
+   { "load", "load", builtin_load, false },
+   { "error", "error", builtin_error, false },
+   { "print", "print", builtin_print, false },
+   { "serialize", "serialize", builtin_serialize, false },
+   { "deserialize", "deserialize", builtin_deserialize, false },
+
+   // lazy sequences
+   { "range", "range", builtin_range, true },
+   { "iterate", "iterate", builtin_iterate, false },
+   { "lines", "lines", builtin_lines, false },
+   { "map", "map", builtin_map, false },
+   { "filter", "filter", builtin_filter, false },
+   { "take", "take", builtin_take, false },
+   { "drop", "drop", builtin_drop, false },
+   { "reduce", "reduce", builtin_reduce, false },
+   { "collect", "collect", builtin_collect, false },
+
+   // loops
+   { "loop", "loop", builtin_loop, false },
+   { "recur", "recur", builtin_recur, false },
+   { "while", "while", builtin_while, false },
+   { "dotimes", "dotimes", builtin_dotimes, false },
+   { "for-each", "for-each", builtin_for_each, false },
+
+   // tasks and channels
+   { "spawn", "spawn", builtin_spawn, false },
+   { "yield", "yield", builtin_yield, false },
+   { "await", "await", builtin_await, false },
+   { "chan", "chan", builtin_chan, false },
+   { "send", "send", builtin_send, false },
+   { "recv", "recv", builtin_recv, false },
+   { "sleep", "sleep", builtin_sleep, false },
+   { "run", "run", builtin_run, false },
+};
+
+#define LBUILTIN_COUNT (int)(sizeof(lbuiltins) / sizeof(lbuiltins[0]))
+
+int lbuiltin_id(lbuiltin func) {
+   for (int i = 0; i < LBUILTIN_COUNT; i++)
+      if (lbuiltins[i].func == func)
+         return i;
+   return -1;
+}
+
+// names bound by lenv_add_builtins, folding treats them as constant
+bool lfold_watched(char *name) {
+   for (int i = 0; i < LBUILTIN_COUNT; i++)
+      if (strcmp(lbuiltins[i].name, name) == 0)
+         return true;
+   return strcmp(name, "pi") == 0 || strcmp(name, "e") == 0
+      || strcmp(name, "true") == 0 || strcmp(name, "false") == 0;
+}
+
+void lenv_add_builtins(lenv *e) {
+   for (int i = 0; i < LBUILTIN_COUNT; i++)
+      if (lbuiltins[i].func != builtin_run || lrun_allowed)
+         lenv_add_builtin(e, lbuiltins[i].name, lbuiltins[i].func);
+
+   lenv_add_var(e, "pi", lval_num(acos(-1)));
+   lenv_add_var(e, "e", lval_num(exp(1)));
+   lenv_add_var(e, "true", lval_int(true));
+   lenv_add_var(e, "false", lval_int(false));
+}
+
+bool lval_is_syms(lval *v);
+
+// modules are shared objects built from C that --compile-c writes for
+// a .lspy file, loaded with 'load' like the file itself. they call the
+// interpreter through an lapi table: they build each form of the file
+// as a value and evaluate it in order, so loading one skips parsing
+// but otherwise does what loading the file does. lambdas in the
+// integer subset the jit takes come with a C version of their body,
+// used with the same guards as jit code. the generated C declares the
+// table from LAPI_FIELDS, so a module only loads into a binary with
+// the same LAPI_VERSION
+
+#define LAPI_VERSION 1
+
+#define LAPI_FIELDS \
+   int version; \
+   lval *(*num)(double x); \
+   lval *(*integer)(long x); \
+   lval *(*sym)(char *s); \
+   lval *(*str)(char *s); \
+   lval *(*sexpr)(void); \
+   lval *(*qexpr)(void); \
+   lval *(*add)(lval *v, lval *x); \
+   void (*form)(lenv *e, lval *v); \
+   void (*native)(lenv *e, char *name, char *uses, char *self, \
+      long (*entry)(long *argv)); \
+   void (*deopt)(void); \
+   char **limit;
+
+typedef struct {
+   LAPI_FIELDS
+} lapi;
+
+#define LSTRINGIFY(x) #x
+#define LSTRING(x) LSTRINGIFY(x)
+
+// evaluate a form of a module like load does
+void lmodule_form(lenv *e, lval *v) {
+   lval *x = lval_eval(e, lval_fold(e, v));
+   lval_println(x);
+   lval_del(x);
+}
+
+// whether every builtin in uses, space separated names, is still bound
+// to itself in the global environment of e. the module was translated
+// with the builtins of a fresh environment in mind
+bool lmodule_resolves(lenv *e, char *uses) {
+   while (e->par)
+      e = e->par;
+
+   char *p = uses;
+   while (*p) {
+      size_t n = strcspn(p, " ");
+      lval *b = NULL;
+      for (int i = 0; i < e->count; i++)
+         if (strncmp(e->syms[i], p, n) == 0 && e->syms[i][n] == '\0')
+            b = e->vals[i];
+      int id = b && b->type == LVAL_FUN && b->builtin
+         ? lbuiltin_id(b->builtin) : -1;
+      if (id < 0 || strncmp(lbuiltins[id].name, p, n) != 0
+         || lbuiltins[id].name[n] != '\0')
+         return false;
+      p += n + (p[n] == ' ');
+   }
+   return true;
+}
+
+// give the lambda bound to name in the global environment the native
+// code entry. uses lists the builtins the code assumes, by name
+void lmodule_native(lenv *e, char *name, char *uses, char *self,
+   long (*entry)(long *argv)) {
+   while (e->par)
+      e = e->par;
+
+   lval *fn = NULL;
+   for (int i = 0; i < e->count; i++)
+      if (strcmp(e->syms[i], name) == 0)
+         fn = e->vals[i];
+   // leave the lambda alone if a builtin it uses was rebound
+   if (!fn || fn->type != LVAL_FUN || fn->builtin || fn->partial
+      || fn->variadic || fn->shadows || !lmodule_resolves(e, uses))
+      return;
+
+   if (fn->jit)
+      ljit_free(fn->jit);
+   ljit *j = lmem_alloc(sizeof(ljit));
+   j->code = NULL;
+   j->entry = entry;
+   j->self = self;
+   j->epoch = lfold.epoch;
+   j->uses = uses;
+   j->native = entry;
+   fn->jit = j;
+}
+
+lapi lapi_table = {
+   LAPI_VERSION,
+   lval_num, lval_int, lval_sym, lval_str, lval_sexpr, lval_qexpr,
+   lval_add, lmodule_form, lmodule_native, ljit_deopt, &ljit_state.limit,
+};
+
+lval *lmodule_load(lenv *e, lval *a) {
+   char *path = a->cell[0]->str;
+   // dlopen only searches the library path for names without a '/'
+   char *local = lmem_alloc(strlen(path) + 3);
+   sprintf(local, strchr(path, '/') ? "%s" : "./%s", path);
+   void *so = dlopen(local, RTLD_NOW | RTLD_LOCAL);
+   lmem_free(local, strlen(path) + 3);
+   if (!so) {
+      // the next dl call reuses dlerror's buffer, the error keeps a copy
+      lval *msg = lval_str(dlerror());
+      lval_del(a);
+      return lval_err_in(msg, "Could not load Library %s", msg->str);
+   }
+
+   int (*init)(lapi *api, lenv *e) = (int (*)(lapi *, lenv *))
+      dlsym(so, "lspy_module");
+   if (!init) {
+      dlclose(so);
+      return lval_err_in(a, "Could not load Library %s, "
+         "it is not a module", path);
+   }
+   if (!init(&lapi_table, e)) {
+      dlclose(so);
+      return lval_err_in(a, "Could not load Library %s, "
+         "it was built for another interpreter", path);
+   }
+   // native code of the module stays in use, the module is never closed
+   lval_del(a);
+   return lval_sym("ok");
+}
+
+// writing a module
+
+typedef struct {
+   FILE *f;
+   int id;         // number of the lambda being translated
+   lval *formals;
+   char *self;     // its name
+   FILE *uses;     // builtins the body uses, space separated
+   bool ok;
+} lcgen;
+
+void lcgen_string(FILE *f, char *s) {
+   fputc('"', f);
+   for (unsigned char *p = (unsigned char *)s; *p; p++) {
+      if (*p == '"' || *p == '\\' || *p == '?')
+         fprintf(f, "\\%c", *p);
+      else if (*p < ' ' || *p > '~')
+         fprintf(f, "\\%03o", *p);
+      else
+         fputc(*p, f);
+   }
+   fputc('"', f);
+}
+
+// C expression building v, nested depth deep
+bool lcgen_value(FILE *f, lval *v, int depth) {
+   switch (v->type) {
+      case LVAL_NUM:
+         if (v->exact && v->inum == LONG_MIN) {
+            fprintf(f, "A->integer(-%ldL - 1)", LONG_MAX);
+         } else if (v->exact) {
+            fprintf(f, "A->integer(%ldL)", v->inum);
+         } else {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "%.17g", v->num);
+            fprintf(f, "A->num(%s%s)", buf, strpbrk(buf, ".e") ? "" : ".0");
+         }
+         return true;
+      case LVAL_SYM:
+         fprintf(f, "A->sym(");
+         lcgen_string(f, v->sym);
+         fprintf(f, ")");
+         return true;
+      case LVAL_STR:
+         fprintf(f, "A->str(");
+         lcgen_string(f, v->str);
+         fprintf(f, ")");
+         return true;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+         fprintf(f, "L(A->%s(), %d", v->type == LVAL_SEXPR ? "sexpr" : "qexpr",
+            v->count);
+         for (int i = 0; i < v->count; i++) {
+            fprintf(f, ",\n%*s", 6 + 3 * depth, "");
+            if (!lcgen_value(f, v->cell[i], depth + 1))
+               return false;
+         }
+         fprintf(f, ")");
+         return true;
+      default:
+         // only errors, from numbers out of range
+         fprintf(stderr, "Could not compile %s\n", lval_err_text(v));
+         return false;
+   }
+}
+
+void lcgen_form(lcgen *g, lval **cell, int count);
+
+int lcgen_formal(lcgen *g, char *sym) {
+   for (int i = 0; i < g->formals->count; i++)
+      if (strcmp(g->formals->cell[i]->sym, sym) == 0)
+         return i;
+   return -1;
+}
+
+// C expression of the value of v, in the subset of ljit_compile
+void lcgen_expr(lcgen *g, lval *v) {
+   if (v->type == LVAL_NUM && v->exact) {
+      if (v->inum == LONG_MIN)
+         fprintf(g->f, "(-%ldL - 1)", LONG_MAX);
+      else
+         fprintf(g->f, "%ldL", v->inum);
+   } else if (v->type == LVAL_SYM && lcgen_formal(g, v->sym) >= 0) {
+      fprintf(g->f, "a%d", lcgen_formal(g, v->sym));
+   } else if (v->type == LVAL_SEXPR) {
+      lcgen_form(g, v->cell, v->count);
+   } else {
+      g->ok = false;
+   }
+}
+
+void lcgen_form(lcgen *g, lval **cell, int count) {
+   if (count == 1) {
+      lcgen_expr(g, cell[0]);
+      return;
+   }
+   if (count == 0 || cell[0]->type != LVAL_SYM
+      || lcgen_formal(g, cell[0]->sym) >= 0) {
+      g->ok = false;
+      return;
+   }
+
+   char *head = cell[0]->sym;
+   int n = count - 1;
+   lval **args = cell + 1;
+
+   if (strcmp(head, g->self) == 0) {
+      if (n != g->formals->count) {
+         g->ok = false;
+         return;
+      }
+      fprintf(g->f, "f%d(", g->id);
+      for (int i = 0; i < n; i++) {
+         if (i)
+            fprintf(g->f, ", ");
+         lcgen_expr(g, args[i]);
+      }
+      fprintf(g->f, ")");
+      return;
+   }
+
+   static char *cmps[] = { "<", ">", "<=", ">=", "==", "!=" };
+   static char *ops[] = { "+", "-", "*" };
+   static char *fns[] = { "add", "sub", "mul" };
+   bool cmp = false;
+   int op = -1;
+   for (int i = 0; i < 6; i++)
+      cmp = cmp || strcmp(head, cmps[i]) == 0;
+   for (int i = 0; i < 3; i++)
+      if (strcmp(head, ops[i]) == 0)
+         op = i;
+
+   bool cond = strcmp(head, "if") == 0;
+   if (cond ? n != 3 || args[1]->type != LVAL_QEXPR
+         || args[2]->type != LVAL_QEXPR
+      : cmp ? n != 2 : op < 0 || n < 1) {
+      g->ok = false;
+      return;
+   }
+   fprintf(g->uses, " %s", head);
+
+   if (cond) {
+      fprintf(g->f, "(");
+      lcgen_expr(g, args[0]);
+      fprintf(g->f, " ? ");
+      lcgen_form(g, args[1]->cell, args[1]->count);
+      fprintf(g->f, " : ");
+      lcgen_form(g, args[2]->cell, args[2]->count);
+      fprintf(g->f, ")");
+   } else if (cmp) {
+      fprintf(g->f, "(long)(");
+      lcgen_expr(g, args[0]);
+      fprintf(g->f, " %s ", head);
+      lcgen_expr(g, args[1]);
+      fprintf(g->f, ")");
+   } else if (op == 1 && n == 1) {
+      fprintf(g->f, "neg(");
+      lcgen_expr(g, args[0]);
+      fprintf(g->f, ")");
+   } else {
+      // left to right, like builtin_op
+      for (int i = 1; i < n; i++)
+         fprintf(g->f, "%s(", fns[op]);
+      lcgen_expr(g, args[0]);
+      for (int i = 1; i < n; i++) {
+         fprintf(g->f, ", ");
+         lcgen_expr(g, args[i]);
+         fprintf(g->f, ")");
+      }
+   }
+}
+
+// the name, formals and body v defines a lambda by, if it is
+// (fun {name formals...} {body}) or (def {name} (\ {formals} {body}))
+bool lcgen_lambda(lval *v, char **name, lval **formals, lval **body) {
+   if (v->type != LVAL_SEXPR || v->count != 3
+      || v->cell[0]->type != LVAL_SYM || v->cell[1]->type != LVAL_QEXPR
+      || v->cell[1]->count == 0 || !lval_is_syms(v->cell[1]))
+      return false;
+
+   if (strcmp(v->cell[0]->sym, "fun") == 0
+      && v->cell[2]->type == LVAL_QEXPR) {
+      *name = v->cell[1]->cell[0]->sym;
+      *formals = lval_copy(v->cell[1]);
+      lval_del(lval_pop(*formals, 0));
+      *body = v->cell[2];
+      return true;
+   }
+
+   lval *l = v->cell[2];
+   if (strcmp(v->cell[0]->sym, "def") == 0 && v->cell[1]->count == 1
+      && l->type == LVAL_SEXPR && l->count == 3
+      && l->cell[0]->type == LVAL_SYM && strcmp(l->cell[0]->sym, "\\") == 0
+      && l->cell[1]->type == LVAL_QEXPR && lval_is_syms(l->cell[1])
+      && l->cell[2]->type == LVAL_QEXPR) {
+      *name = v->cell[1]->cell[0]->sym;
+      *formals = lval_ref(l->cell[1]);
+      *body = l->cell[2];
+      return true;
+   }
+   return false;
+}
+
+// C of the native version of lambda number id, if it has one. prints
+// the builtins it uses into uses
+bool lcgen_native(FILE *out, int id, char *name, lval *formals,
+   lval *body, char **uses) {
+   if (formals->count > 64)
+      return false;
+   for (int i = 0; i < formals->count; i++)
+      if (strcmp(formals->cell[i]->sym, "&") == 0
+         || lfold_watched(formals->cell[i]->sym)
+         || strcmp(formals->cell[i]->sym, name) == 0)
+         return false;
+
+   char *code;
+   size_t len, nuses;
+   lcgen g = { open_memstream(&code, &len), id, formals, name,
+      open_memstream(uses, &nuses), true };
+   lcgen_form(&g, body->cell, body->count);
+   fclose(g.f);
+   fclose(g.uses);
+
+   if (g.ok) {
+      fprintf(out, "static long f%d(", id);
+      for (int i = 0; i < formals->count; i++)
+         fprintf(out, i ? ", long a%d" : "long a%d", i);
+      fprintf(out, formals->count ? ") {\n" : "void) {\n");
+      fprintf(out, "   char sp;\n");
+      fprintf(out, "   if (&sp < *A->limit)\n      A->deopt();\n");
+      fprintf(out, "   return %s;\n}\n\n", code);
+      fprintf(out, "static long f%d_entry(long *argv) {\n   return f%d(",
+         id, id);
+      for (int i = 0; i < formals->count; i++)
+         fprintf(out, i ? ", argv[%d]" : "argv[%d]", i);
+      fprintf(out, ");\n}\n\n");
+   }
+   free(code);
+   if (!g.ok)
+      free(*uses);
+   return g.ok;
+}
+
+// write a module of the file at path to out
+bool lcompile_c(char *path, FILE *out) {
+   mpc_result_t r;
+   if (!mpc_parse_contents(path, Lispy, &r)) {
+      mpc_err_print_to(r.error, stderr);
+      mpc_err_delete(r.error);
+      return false;
+   }
+   lval *forms = lval_read(r.output);
+   mpc_ast_delete(r.output);
+
+   fprintf(out,
+      "// module of %s, written by main --compile-c. build it with\n"
+      "//   cc -shared -fPIC -O2 module.c -o module.so\n"
+      "// and load module.so in place of the file\n\n", path);
+   fprintf(out, "typedef struct lval lval;\ntypedef struct lenv lenv;\n");
+   fprintf(out, "typedef struct {\n   ");
+   for (char *p = LSTRING(LAPI_FIELDS); *p; p++) {
+      fputc(*p, out);
+      if (*p == ';')
+         fputs(p[1] ? "\n  " : "\n", out);
+   }
+   fprintf(out, "} lapi;\n\n");
+   fprintf(out, "#include <stdarg.h>\n\nstatic lapi *A;\n\n");
+   fprintf(out,
+      "static lval *L(lval *v, int n, ...) {\n"
+      "   va_list va;\n"
+      "   va_start(va, n);\n"
+      "   for (int i = 0; i < n; i++)\n"
+      "      v = A->add(v, va_arg(va, lval *));\n"
+      "   va_end(va);\n"
+      "   return v;\n"
+      "}\n\n");
+   fprintf(out,
+      "// integer arithmetic, gives up on overflow\n"
+      "static inline long add(long x, long y) {\n"
+      "   long r;\n"
+      "   if (__builtin_add_overflow(x, y, &r))\n      A->deopt();\n"
+      "   return r;\n}\n\n"
+      "static inline long sub(long x, long y) {\n"
+      "   long r;\n"
+      "   if (__builtin_sub_overflow(x, y, &r))\n      A->deopt();\n"
+      "   return r;\n}\n\n"
+      "static inline long mul(long x, long y) {\n"
+      "   long r;\n"
+      "   if (__builtin_mul_overflow(x, y, &r))\n      A->deopt();\n"
+      "   return r;\n}\n\n"
+      "static inline long neg(long x) {\n"
+      "   return sub(0, x);\n}\n\n");
+
+   // native bodies first, the init function below refers to them
+   bool *native = calloc(forms->count + 1, sizeof(bool));
+   char **uses = calloc(forms->count + 1, sizeof(char *));
+   for (int i = 0; i < forms->count; i++) {
+      char *name;
+      lval *formals, *body;
+      if (lcgen_lambda(forms->cell[i], &name, &formals, &body)) {
+         native[i] = lcgen_native(out, i, name, formals, body, &uses[i]);
+         lval_del(formals);
+      }
+   }
+
+   bool ok = true;
+   fprintf(out, "int lspy_module(lapi *api, lenv *e) {\n");
+   fprintf(out, "   if (api->version != %d)\n      return 0;\n", LAPI_VERSION);
+   fprintf(out, "   A = api;\n");
+   for (int i = 0; ok && i < forms->count; i++) {
+      fprintf(out, "\n   A->form(e, ");
+      ok = lcgen_value(out, forms->cell[i], 0);
+      fprintf(out, ");\n");
+      if (native[i]) {
+         char *name;
+         lval *formals, *body;
+         lcgen_lambda(forms->cell[i], &name, &formals, &body);
+         lval_del(formals);
+         fprintf(out, "   A->native(e, ");
+         lcgen_string(out, name);
+         fprintf(out, ", \"%s\", ", uses[i][0] ? uses[i] + 1 : "");
+         lcgen_string(out, name);
+         fprintf(out, ", f%d_entry);\n", i);
+         free(uses[i]);
+      }
+   }
+   fprintf(out, "   return 1;\n}\n");
+
+   free(native);
+   free(uses);
+   lval_del(forms);
+   return ok;
+}
+
+void lenv_print(lenv *e) {
+   for (int i = 0; i < e->count; i++) {
+      printf("%s: ", e->syms[i]);
+      lval_println(e->vals[i]);
+   }
+}
+
+
+lval *builtin_eval(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1, 
+      "Funciton 'eval' passed too many arugments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+      "Function 'eval' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+
+   return lval_eval_sexpr(e, lval_take(a, 0));
+}
+
+void lval_function_print(lbuiltin f) {
+   int id = lbuiltin_id(f);
+   if (id >= 0)
+      printf("<function '%s'>", lbuiltins[id].label);
+}
+
+// special forms are evaluated straight from the unevaluated expression
+// v, with the function in v->cell[0] already evaluated. they return
+// NULL and leave v alone when v is not in the shape they handle, the
+// builtin then reports whatever is wrong with it.
+
+// (if cond {then} {else}), evaluating only the branch taken
+lval *lval_eval_if(lenv *e, lval *v) {
+   if (v->count != 4)
+      return NULL;
+
+   // branches are usually literal Q-Expressions, which evaluate to
+   // themselves, so only anything else needs evaluating
+   for (int i = 1; i < v->count; i++)
+      if (i == 1 || v->cell[i]->type != LVAL_QEXPR)
+         v->cell[i] = lval_eval(e, v->cell[i]);
+
+   for (int i = 1; i < v->count; i++)
+      if (v->cell[i]->type == LVAL_ERR)
+         return lloop_misplaced(lval_take(v, i));
+
+   for (int i = 1; i < v->count; i++) {
+      int type = (i == 1) ? LVAL_NUM : LVAL_QEXPR;
+      if (v->cell[i]->type != type) {
+         lval *err = lval_err(
+            "Function 'if' passed incorrect type for argument %i. "
+            "Got %s, expected %s.",
+            i - 1, ltype_name(v->cell[i]->type), ltype_name(type));
+         lval_del(v);
+         return err;
+      }
+   }
+
+   return lval_eval_sexpr(e, lval_take(v, v->cell[1]->num ? 2 : 3));
+}
+
+bool lval_is_syms(lval *v) {
+   for (int i = 0; i < v->count; i++)
+      if (v->cell[i]->type != LVAL_SYM)
+         return false;
+   return true;
+}
+
+// (\ {formals} {body}), sharing both with the expression
+lval *lval_eval_lambda(lenv *e, lval *v) {
+   if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR
+      || v->cell[2]->type != LVAL_QEXPR || !lval_is_syms(v->cell[1]))
+      return NULL;
+
+   lval *x = lval_lambda(lval_ref(v->cell[1]), lval_ref(v->cell[2]));
+   lval_del(v);
+   return x;
+}
+
+// (fun {name formals} {body})
+lval *lval_eval_fun(lenv *e, lval *v) {
+   if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR
+      || v->cell[2]->type != LVAL_QEXPR || v->cell[1]->count == 0
+      || !lval_is_syms(v->cell[1]))
+      return NULL;
+
+   lval *formals = lval_copy(v->cell[1]);
+   lval *name = lval_pop(formals, 0);
+   lval *f = lval_lambda(formals, lval_ref(v->cell[2]));
+   lenv_def(e, name, f);
+   lval_del(name);
+   lval_del(f);
+   lval_del(v);
+   return lval_sym("ok");
+}
+
+lval *lval_eval_sexpr(lenv *e, lval *v) {
+   if (lfold_valid(v)) {
+      lval *x = lval_ref(v->fold);
+      lval_del(v);
+      return x;
+   }
+
+   // children are replaced in place, so the cells must be private.
+   // they go on the value stack, where they become the arguments
+   v = lval_own(v);
+   if (v->count && !(lval_private_cells(v) && v->store->chunk))
+      lval_move_cells(v, lstack_push(v->count));
+
+   // the function goes first, special forms take their arguments
+   // unevaluated
+   int first = 0;
+   if (v->count > 1 && !lreference) {
+      v->cell[0] = lval_eval(e, v->cell[0]);
+      first = 1;
+
+      lbuiltin special = v->cell[0]->type == LVAL_FUN
+         ? v->cell[0]->builtin : NULL;
+      lval *x = NULL;
+      if (special == builtin_if)     x = lval_eval_if(e, v);
+      if (special == builtin_lambda) x = lval_eval_lambda(e, v);
+      if (special == builtin_fun)    x = lval_eval_fun(e, v);
+      if (x)
+         return x;
+   }
+
+   // eval children
+   for (int i = first; i < v->count; i++) 
+      v->cell[i] = lval_eval(e, v->cell[i]); 
    
-   // error check
+   // error check, a lone expression is in the tail
    for (int i = 0; i < v->count; i++)
       if (v->cell[i]->type == LVAL_ERR)
-         return lval_take(v, i); 
+         return v->count > 1
+            ? lloop_misplaced(lval_take(v, i)) : lval_take(v, i);
 
-   // empty expresison
-   if (v->count == 0)
+   // empty expresison, v may have been a Q-Expression evaluated as one
+   if (v->count == 0) {
+      v->type = LVAL_SEXPR;
       return v;
+   }
 
    // single expression 
    if (v->count == 1)
@@ -1248,10 +4567,24 @@ lval *lval_eval_sexpr(lenv *e, lval *v) {
 }
 
 lval *lval_eval(lenv *e, lval *v) {
+   if (llimit.active) {
+      lval *err = llimit_step();
+      if (err) {
+         lval_del(v);
+         return err;
+      }
+   }
+
    if (v->type == LVAL_SEXPR)
       return lval_eval_sexpr(e, v);
 
    if (v->type == LVAL_SYM) {
+      if (lfold_valid(v)) {
+         lval *x = lval_ref(v->fold);
+         lval_del(v);
+         return x;
+      }
+
       lval *x = lenv_get(e, v);
       if (x->type == LVAL_FUN) {
          if (x->builtin == builtin_exit) // exit
@@ -1259,10 +4592,78 @@ lval *lval_eval(lenv *e, lval *v) {
          if (x->builtin == builtin_env) // list env
             x->builtin(e, v);
       }
-      lval_del(v);
-      return x;
+      lval_del(v);
+      return x;
+   }
+
+   return v;
+}
+
+// folding computes the value of constant expressions once, ahead of
+// their evaluation, and keeps it in the expression. a symbol is
+// constant when it names a builtin or a constant, an expression when
+// every element is constant and it calls a pure builtin. the values
+// are only used while they still hold, see lfold_valid. returns
+// whether v evaluates to a constant
+bool lval_fold_node(lenv *e, lval *v) {
+   if (v->type == LVAL_NUM || v->type == LVAL_STR)
+      return true;
+   if (v->type != LVAL_SYM && v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+      return false;
+
+   if (v->epoch != lfold.epoch) {
+      if (v->fold) {
+         lval_del(v->fold);
+         v->fold = NULL;
+      }
+      v->epoch = lfold.epoch;
+
+      if (v->type == LVAL_SYM) {
+         // exit and env act when merely looked up
+         if (lfold_watched(v->sym)) {
+            lval *x = lenv_get(e, v);
+            if (x->type == LVAL_ERR || (x->type == LVAL_FUN
+               && (x->builtin == builtin_exit || x->builtin == builtin_env)))
+               lval_del(x);
+            else
+               v->fold = x;
+         }
+      } else {
+         bool constant = v->count > 0;
+         for (int i = 0; i < v->count; i++)
+            if (!lval_fold_node(e, v->cell[i]))
+               constant = false;
+
+         if (constant && v->count > 1) {
+            lval *f = v->cell[0]->fold;
+            int id = f && f->type == LVAL_FUN && f->builtin
+               ? lbuiltin_id(f->builtin) : -1;
+            constant = v->cell[0]->type == LVAL_SYM
+               && id >= 0 && lbuiltins[id].pure;
+         }
+
+         // a Q-Expression is folded for when it is evaluated as code,
+         // like a lambda body or a branch of if
+         if (constant) {
+            lval *x = lval_eval_sexpr(e, lval_ref(v));
+            if (x->type == LVAL_ERR)
+               lval_del(x);
+            else
+               v->fold = x;
+         }
+      }
    }
 
+   return v->type == LVAL_QEXPR || v->fold;
+}
+
+// fold v against the global environment, unless something shadows it
+lval *lval_fold(lenv *e, lval *v) {
+   if (lfold.shadow || lreference)
+      return v;
+   while (e->par)
+      e = e->par;
+   lval_fold_node(e, v);
    return v;
 }
 
@@ -1313,7 +4714,1143 @@ int max_children_from_branch(mpc_ast_t *t) {
 }
 #endif
 
+// binary encoding of values. counts and lengths are LEB128 varints,
+// whole numbers are zigzag varints and anything else a raw double in
+// the host byte order. a stream is just encoded values back to back
+enum {
+   LTAG_NUM = 1,
+   LTAG_ERR,
+   LTAG_SYM,
+   LTAG_STR,
+   LTAG_SEXPR,
+   LTAG_QEXPR,
+   LTAG_BUILTIN,
+   LTAG_LAMBDA,
+   LTAG_INT,
+   LTAG_SEQ,
+};
+
+void lenc_uint(FILE *f, unsigned long x) {
+   do {
+      int b = x & 0x7f;
+      x >>= 7;
+      fputc(x ? b | 0x80 : b, f);
+   } while (x);
+}
+
+void lenc_str(FILE *f, char *s) {
+   size_t n = strlen(s);
+   lenc_uint(f, n);
+   fwrite(s, 1, n, f);
+}
+
+void lenv_encode(FILE *f, lenv *e);
+
+void lval_encode(FILE *f, lval *v) {
+   switch (v->type) {
+      case LVAL_NUM:
+         if (v->exact) {
+            long x = v->inum;
+            fputc(LTAG_INT, f);
+            lenc_uint(f, ((unsigned long)x << 1) ^ (unsigned long)(x >> 63));
+         } else {
+            fputc(LTAG_NUM, f);
+            fwrite(&v->num, sizeof(double), 1, f);
+         }
+         break;
+      case LVAL_ERR: fputc(LTAG_ERR, f); lenc_str(f, lval_err_text(v)); break;
+      // what is queued on a channel belongs to this process alone
+      case LVAL_CHAN:
+         fputc(LTAG_ERR, f);
+         lenc_str(f, "Channels cannot be serialized.");
+         break;
+      case LVAL_SYM: fputc(LTAG_SYM, f); lenc_str(f, v->sym); break;
+      case LVAL_STR: fputc(LTAG_STR, f); lenc_str(f, v->str); break;
+      case LVAL_SEXPR:
+      case LVAL_QEXPR:
+         fputc(v->type == LVAL_SEXPR ? LTAG_SEXPR : LTAG_QEXPR, f);
+         lenc_uint(f, v->count);
+         for (int i = 0; i < v->count; i++)
+            lval_encode(f, v->cell[i]);
+         break;
+      case LVAL_FUN:
+         if (v->builtin) {
+            fputc(LTAG_BUILTIN, f);
+            lenc_uint(f, lbuiltin_id(v->builtin));
+         } else if (v->partial) {
+            // written as the lambda with the held arguments bound in
+            // its environment and dropped from its formals
+            lval *p = v->partial;
+            int bound = v->args->count;
+            fputc(LTAG_LAMBDA, f);
+            lenc_uint(f, p->env->count + bound);
+            for (int i = 0; i < p->env->count; i++) {
+               lenc_str(f, p->env->syms[i]);
+               lval_encode(f, p->env->vals[i]);
+            }
+            for (int i = 0; i < bound; i++) {
+               lenc_str(f, p->formals->cell[i]->sym);
+               lval_encode(f, v->args->cell[i]);
+            }
+            fputc(LTAG_QEXPR, f);
+            lenc_uint(f, p->formals->count - bound);
+            for (int i = bound; i < p->formals->count; i++)
+               lval_encode(f, p->formals->cell[i]);
+            lval_encode(f, p->body);
+         } else {
+            fputc(LTAG_LAMBDA, f);
+            lenv_encode(f, v->env);
+            lval_encode(f, v->formals);
+            lval_encode(f, v->body);
+         }
+         break;
+      case LVAL_SEQ: {
+         // kind, bounds, then a bit for each of fn, src and path present
+         lseq *s = v->seq;
+         fputc(LTAG_SEQ, f);
+         lenc_uint(f, s->kind);
+         fwrite(&s->from, sizeof(double), 1, f);
+         fwrite(&s->to, sizeof(double), 1, f);
+         fwrite(&s->step, sizeof(double), 1, f);
+         lenc_uint(f, (s->fn ? 1 : 0) | (s->src ? 2 : 0) | (s->path ? 4 : 0));
+         if (s->fn)
+            lval_encode(f, s->fn);
+         if (s->src)
+            lval_encode(f, s->src);
+         if (s->path)
+            lenc_str(f, s->path);
+         break;
+      }
+   }
+}
+
+void lenv_encode(FILE *f, lenv *e) {
+   lenc_uint(f, e->count);
+   for (int i = 0; i < e->count; i++) {
+      lenc_str(f, e->syms[i]);
+      lval_encode(f, e->vals[i]);
+   }
+}
+
+// decoding reads from memory and never trusts the input
+typedef struct {
+   const unsigned char *p;
+   const unsigned char *end;
+   int depth;      // values being decoded around the current one
+} ldec;
+
+// values nested deeper than this are taken for malformed input rather
+// than decoded at the cost of the C stack
+#define LDEC_DEPTH 10000
+
+bool ldec_uint(ldec *d, unsigned long *x) {
+   *x = 0;
+   for (int shift = 0; d->p < d->end && shift < 64; shift += 7) {
+      int b = *d->p++;
+      *x |= (unsigned long)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+         return true;
+   }
+   return false;
+}
+
+char *ldec_str(ldec *d) {
+   unsigned long n;
+   if (!ldec_uint(d, &n) || n > (unsigned long)(d->end - d->p))
+      return NULL;
+   char *s = lmem_alloc(n + 1);
+   memcpy(s, d->p, n);
+   s[n] = '\0';
+   d->p += n;
+   return s;
+}
+
+bool lenv_decode(ldec *d, lenv *e);
+lval *lval_decode(ldec *d);
+
+lval *ldec_value(ldec *d) {
+   if (d->p >= d->end)
+      return NULL;
+
+   lval *v = NULL;
+   unsigned long n;
+   switch (*d->p++) {
+      case LTAG_NUM:
+         if (d->end - d->p < (long)sizeof(double))
+            return NULL;
+         v = lval_num(0);
+         memcpy(&v->num, d->p, sizeof(double));
+         d->p += sizeof(double);
+         return v;
+
+      case LTAG_INT:
+         if (!ldec_uint(d, &n))
+            return NULL;
+         return lval_int((long)(n >> 1) ^ -(long)(n & 1));
+
+      case LTAG_ERR:
+      case LTAG_SYM:
+      case LTAG_STR: {
+         int tag = d->p[-1];
+         char *s = ldec_str(d);
+         if (!s)
+            return NULL;
+         v = lval_alloc(tag == LTAG_ERR ? LVAL_ERR
+            : tag == LTAG_SYM ? LVAL_SYM : LVAL_STR);
+         if (tag == LTAG_ERR) {
+            // already formatted, the template is never expanded
+            v->err = lmem_alloc(sizeof(lerr));
+            v->err->text = s;
+            v->err->fmt = "%s";
+            v->err->held = NULL;
+         }
+         if (tag == LTAG_SYM) v->sym = s;
+         if (tag == LTAG_STR) v->str = s;
+         return v;
+      }
+
+      case LTAG_SEXPR:
+      case LTAG_QEXPR:
+         v = d->p[-1] == LTAG_SEXPR ? lval_sexpr() : lval_qexpr();
+         if (!ldec_uint(d, &n) || n > (unsigned long)(d->end - d->p)) {
+            lval_del(v);
+            return NULL;
+         }
+         for (unsigned long i = 0; i < n; i++) {
+            lval *x = lval_decode(d);
+            if (!x) {
+               lval_del(v);
+               return NULL;
+            }
+            v = lval_add(v, lintern_value(x));
+         }
+         return v;
+
+      case LTAG_BUILTIN:
+         if (!ldec_uint(d, &n) || n >= LBUILTIN_COUNT)
+            return NULL;
+         return lval_fun(lbuiltins[n].func);
+
+      case LTAG_LAMBDA: {
+         lenv *env = lenv_new();
+         lval *formals = NULL, *body = NULL;
+         if (!lenv_decode(d, env) || !(formals = lval_decode(d))
+            || !(body = lval_decode(d)) || formals->type != LVAL_QEXPR
+            || !lval_is_syms(formals) || body->type != LVAL_QEXPR) {
+            lenv_del(env);
+            if (formals)
+               lval_del(formals);
+            if (body)
+               lval_del(body);
+            return NULL;
+         }
+         v = lval_lambda(formals, body);
+         lenv_del(v->env);
+         v->env = env;
+         return v;
+      }
+
+      case LTAG_SEQ: {
+         unsigned long kind, has;
+         if (!ldec_uint(d, &kind) || kind > LSEQ_DROP
+            || d->end - d->p < 3 * (long)sizeof(double))
+            return NULL;
+         v = lval_seq(kind);
+         lseq *s = v->seq;
+         memcpy(&s->from, d->p, sizeof(double));
+         memcpy(&s->to, d->p + sizeof(double), sizeof(double));
+         memcpy(&s->step, d->p + 2 * sizeof(double), sizeof(double));
+         d->p += 3 * sizeof(double);
+         if (!ldec_uint(d, &has)
+            || ((has & 1) && !(s->fn = lval_decode(d)))
+            || ((has & 2) && !(s->src = lval_decode(d)))
+            || ((has & 4) && !(s->path = ldec_str(d)))) {
+            lval_del(v);
+            return NULL;
+         }
+
+         // cursors rely on every field their kind uses being there
+         bool fn = kind == LSEQ_ITERATE || kind == LSEQ_MAP
+            || kind == LSEQ_FILTER;
+         bool src = kind != LSEQ_RANGE && kind != LSEQ_LINES;
+         bool ok = (!fn || (s->fn && s->fn->type == LVAL_FUN))
+            && (!src || (s->src && (kind == LSEQ_ITERATE
+               || s->src->type == LVAL_SEQ || s->src->type == LVAL_QEXPR)))
+            && (kind != LSEQ_LINES || s->path)
+            && (kind != LSEQ_RANGE || s->step != 0);
+         if (!ok) {
+            lval_del(v);
+            return NULL;
+         }
+         return v;
+      }
+   }
+   return NULL;
+}
+
+// decode one value, NULL if the input is malformed
+lval *lval_decode(ldec *d) {
+   if (d->depth >= LDEC_DEPTH)
+      return NULL;
+   d->depth++;
+   lval *v = ldec_value(d);
+   d->depth--;
+   return v;
+}
+
+bool lenv_decode(ldec *d, lenv *e) {
+   unsigned long n;
+   if (!ldec_uint(d, &n))
+      return false;
+   for (unsigned long i = 0; i < n; i++) {
+      char *sym = ldec_str(d);
+      if (!sym)
+         return false;
+      lval *k = lval_alloc(LVAL_SYM);
+      k->sym = sym;
+      lval *v = lval_decode(d);
+      if (v) {
+         lenv_put(e, k, v);
+         lval_del(v);
+      }
+      lval_del(k);
+      if (!v)
+         return false;
+   }
+   return true;
+}
+
+// images start with a magic string and a fingerprint of the builtin
+// table, a binary with different builtins must not load them
+#define LIMAGE_MAGIC "LSPYIMG1"
+
+unsigned long limage_fingerprint() {
+   unsigned long h = 2166136261u;
+   for (int i = 0; i < LBUILTIN_COUNT; i++)
+      for (char *c = lbuiltins[i].name; *c; c++)
+         h = ((h ^ (unsigned char)*c) * 16777619u) & 0xffffffff;
+   return h;
+}
+
+// write the global environment of e to an image at path
+bool limage_save(lenv *e, char *path) {
+   while (e->par)
+      e = e->par;
+
+   FILE *f = fopen(path, "wb");
+   if (!f)
+      return false;
+   fputs(LIMAGE_MAGIC, f);
+   lenc_uint(f, limage_fingerprint());
+   lenv_encode(f, e);
+   return fclose(f) == 0;
+}
+
+// contents of a file, mapped when it is a regular file and read
+// otherwise so that pipes work too
+typedef struct {
+   unsigned char *data;
+   size_t len;
+   bool mapped;
+} lfile;
+
+bool lfile_open(lfile *f, char *path) {
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return false;
+
+   struct stat st;
+   f->data = NULL;
+   f->len = 0;
+   f->mapped = false;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      if (st.st_size > 0) {
+         void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (p == MAP_FAILED) {
+            close(fd);
+            return false;
+         }
+         f->data = p;
+         f->len = st.st_size;
+         f->mapped = true;
+      }
+      close(fd);
+      return true;
+   }
+
+   size_t cap = 0;
+   ssize_t n = 0;
+   do {
+      f->len += n;
+      if (f->len == cap) {
+         cap = cap ? cap * 2 : 4096;
+         f->data = realloc(f->data, cap);
+      }
+   } while ((n = read(fd, f->data + f->len, cap - f->len)) > 0);
+   close(fd);
+   return n == 0;
+}
+
+void lfile_close(lfile *f) {
+   if (f->mapped)
+      munmap(f->data, f->len);
+   else
+      free(f->data);
+}
+
+// fill e from an image written by limage_save
+bool limage_load(lenv *e, char *path) {
+   lfile f;
+   if (!lfile_open(&f, path))
+      return false;
+
+   ldec d = { f.data, f.data + f.len };
+   size_t magic = strlen(LIMAGE_MAGIC);
+   unsigned long print;
+   bool ok = f.len > magic && memcmp(d.p, LIMAGE_MAGIC, magic) == 0;
+   if (ok) {
+      d.p += magic;
+      ok = ldec_uint(&d, &print) && print == limage_fingerprint()
+         && lenv_decode(&d, e) && d.p == d.end;
+   }
+
+   lfile_close(&f);
+   return ok;
+}
+
+// parsed top level forms of the files passed to load, keyed by the
+// canonical path and valid while the size and modification time of the
+// file stay the same. most files are loaded once, so forms are only
+// kept from the second load of a file on, and only for the
+// LCACHE_ENTRIES files loaded most recently. with --load-cache DIR
+// every file parsed is also written to a file in DIR, so a later run
+// that loads the same files skips parsing them too
+#define LCACHE_MAGIC "LSPYLOD1"
+#define LCACHE_ENTRIES 32
+
+typedef struct {
+   char *path;
+   off_t size;
+   struct timespec mtime;
+   lval *forms;    // NULL until the file is loaded a second time
+   long loads;
+   long used;      // value of lcache.clock at the last load
+} lcached;
+
+struct {
+   char *dir;
+   lcached *items;
+   int count;
+   long clock;
+   long hits;
+   long parses;
+} lcache;
+
+// files of the cache directory not used for LCACHE_DAYS are removed,
+// and past LCACHE_FILES the ones used longest ago
+#define LCACHE_DAYS 30
+#define LCACHE_FILES 256
+
+// file in the cache directory holding the entry for path
+char *lcache_file(char *path) {
+   unsigned long h = 14695981039346656037ul;
+   for (char *c = path; *c; c++)
+      h = (h ^ (unsigned char)*c) * 1099511628211ul;
+   char *name = malloc(strlen(lcache.dir) + 24);
+   sprintf(name, "%s/%016lx.lc", lcache.dir, h);
+   return name;
+}
+
+// forms of the cache file for c, NULL when there is none or it was
+// written for another version of the file
+lval *lcache_fetch(lcached *c) {
+   char *name = lcache_file(c->path);
+   lfile f;
+   bool open = lfile_open(&f, name);
+   if (!open) {
+      free(name);
+      return NULL;
+   }
+
+   ldec d = { f.data, f.data + f.len };
+   size_t magic = strlen(LCACHE_MAGIC);
+   lval *forms = NULL;
+   if (f.len > magic && memcmp(d.p, LCACHE_MAGIC, magic) == 0) {
+      d.p += magic;
+      char *path = ldec_str(&d);
+      unsigned long size, sec, nsec;
+      if (path && strcmp(path, c->path) == 0
+         && ldec_uint(&d, &size) && size == (unsigned long)c->size
+         && ldec_uint(&d, &sec) && sec == (unsigned long)c->mtime.tv_sec
+         && ldec_uint(&d, &nsec) && nsec == (unsigned long)c->mtime.tv_nsec)
+         forms = lval_decode(&d);
+      if (path)
+         lstr_free(path);
+   }
+   if (forms && (forms->type != LVAL_SEXPR || d.p != d.end)) {
+      lval_del(forms);
+      forms = NULL;
+   }
+
+   lfile_close(&f);
+   // the modification time of a cache file is when it was last used
+   if (forms)
+      utimensat(AT_FDCWD, name, NULL, 0);
+   free(name);
+   return forms;
+}
+
+typedef struct {
+   char *name;
+   time_t used;
+} lcache_entry;
+
+int lcache_cmp(const void *a, const void *b) {
+   time_t x = ((const lcache_entry *)a)->used;
+   time_t y = ((const lcache_entry *)b)->used;
+   return (x < y) - (x > y);
+}
+
+// remove the files of the cache directory past their age or count. a
+// source file that changes has its cache file rewritten in place, so
+// these are left over from files no longer loaded
+void lcache_prune(void) {
+   DIR *d = opendir(lcache.dir);
+   if (!d)
+      return;
+
+   lcache_entry *files = NULL;
+   int count = 0, cap = 0;
+   time_t old = time(NULL) - LCACHE_DAYS * 24 * 3600;
+   struct dirent *de;
+   while ((de = readdir(d))) {
+      size_t len = strlen(de->d_name);
+      if (len < 3 || strcmp(de->d_name + len - 3, ".lc") != 0)
+         continue;
+      char *name = malloc(strlen(lcache.dir) + len + 2);
+      sprintf(name, "%s/%s", lcache.dir, de->d_name);
+      struct stat st;
+      if (stat(name, &st) != 0 || st.st_mtime < old) {
+         remove(name);
+         free(name);
+         continue;
+      }
+      if (count == cap) {
+         cap = cap ? cap * 2 : 64;
+         files = realloc(files, sizeof(lcache_entry) * cap);
+      }
+      files[count].name = name;
+      files[count].used = st.st_mtime;
+      count++;
+   }
+   closedir(d);
+
+   // most recently used first
+   qsort(files, count, sizeof(lcache_entry), lcache_cmp);
+   for (int i = 0; i < count; i++) {
+      if (i >= LCACHE_FILES)
+         remove(files[i].name);
+      free(files[i].name);
+   }
+   free(files);
+}
+
+// write the forms of the file of entry c to the cache directory. a
+// temporary file renamed into place keeps runs sharing the directory
+// from reading half of it
+void lcache_store(lcached *c, lval *forms) {
+   char *name = lcache_file(c->path);
+   char *tmp = malloc(strlen(name) + 16);
+   sprintf(tmp, "%s.%d", name, (int)getpid());
+
+   FILE *f = fopen(tmp, "wb");
+   if (f) {
+      fputs(LCACHE_MAGIC, f);
+      lenc_str(f, c->path);
+      lenc_uint(f, c->size);
+      lenc_uint(f, c->mtime.tv_sec);
+      lenc_uint(f, c->mtime.tv_nsec);
+      lval_encode(f, forms);
+      if (fclose(f) != 0 || rename(tmp, name) != 0)
+         remove(tmp);
+   }
+
+   free(tmp);
+   free(name);
+   lcache_prune();
+}
+
+// top level forms of the file at path, parsed or from the cache. NULL
+// with *err set when the file does not parse
+lval *lcache_read(char *path, mpc_err_t **err) {
+   struct stat st;
+   char *real = realpath(path, NULL);
+   if (!real || stat(real, &st) != 0 || !S_ISREG(st.st_mode)) {
+      // not a file the cache can tell apart from its next version
+      free(real);
+      mpc_result_t r;
+      if (!mpc_parse_contents(path, Lispy, &r)) {
+         *err = r.error;
+         return NULL;
+      }
+      lval *forms = lval_read(r.output);
+      mpc_ast_delete(r.output);
+      lcache.parses++;
+      return forms;
+   }
+
+   lcached *c = NULL;
+   for (int i = 0; i < lcache.count && !c; i++)
+      if (strcmp(lcache.items[i].path, real) == 0)
+         c = &lcache.items[i];
+
+   if (c) {
+      free(real);
+   } else if (lcache.count < LCACHE_ENTRIES) {
+      lcache.items = realloc(lcache.items,
+         sizeof(lcached) * (lcache.count + 1));
+      c = &lcache.items[lcache.count++];
+      c->path = real;
+      c->forms = NULL;
+      c->loads = 0;
+   } else {
+      // the entry of the file loaded longest ago makes room
+      c = &lcache.items[0];
+      for (int i = 1; i < lcache.count; i++)
+         if (lcache.items[i].used < c->used)
+            c = &lcache.items[i];
+      free(c->path);
+      if (c->forms)
+         lval_del(c->forms);
+      c->path = real;
+      c->forms = NULL;
+      c->loads = 0;
+   }
+   c->used = ++lcache.clock;
+   c->loads++;
+
+   if (c->forms && c->size == st.st_size
+      && c->mtime.tv_sec == st.st_mtim.tv_sec
+      && c->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+      lcache.hits++;
+      return lval_copy(c->forms);
+   }
+   if (c->forms) {
+      lval_del(c->forms);
+      c->forms = NULL;
+   }
+   c->size = st.st_size;
+   c->mtime = st.st_mtim;
+
+   lval *forms = lcache.dir ? lcache_fetch(c) : NULL;
+   if (forms) {
+      lcache.hits++;
+   } else {
+      mpc_result_t r;
+      if (!mpc_parse_contents(path, Lispy, &r)) {
+         *err = r.error;
+         return NULL;
+      }
+      forms = lval_read(r.output);
+      mpc_ast_delete(r.output);
+      lcache.parses++;
+      if (lcache.dir)
+         lcache_store(c, forms);
+   }
+
+   if (c->loads < 2)
+      return forms;
+   c->forms = forms;
+   return lval_copy(forms);
+}
+
+void lcache_clear(void) {
+   for (int i = 0; i < lcache.count; i++) {
+      free(lcache.items[i].path);
+      if (lcache.items[i].forms)
+         lval_del(lcache.items[i].forms);
+   }
+   free(lcache.items);
+   lcache.items = NULL;
+   lcache.count = 0;
+}
+
+// write every value after the path to the end of the file
+lval *builtin_serialize(lenv *e, lval *a) {
+   LASSERT(a, a->count >= 1,
+      "Function 'serialize' passed too few arguments. "
+      "Got %i, expected at least %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_STR,
+      "Function 'serialize' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+   FILE *f = fopen(a->cell[0]->str, "ab");
+   LASSERT(a, f,
+      "Function 'serialize' could not open '%s'.", a->cell[0]->str);
+
+   for (int i = 1; i < a->count; i++)
+      lval_encode(f, a->cell[i]);
+
+   bool ok = fclose(f) == 0;
+   LASSERT(a, ok,
+      "Function 'serialize' could not write '%s'.", a->cell[0]->str);
+
+   lval_del(a);
+   return lval_sym("ok");
+}
+
+// read every value in a file written by serialize into a list
+lval *builtin_deserialize(lenv *e, lval *a) {
+   LASSERT(a, a->count == 1,
+      "Function 'deserialize' passed too many arguments. "
+      "Got %i, expected %i.",
+      a->count, 1);
+
+   LASSERT(a, a->cell[0]->type == LVAL_STR,
+      "Function 'deserialize' passed incorrect type for argument 0. "
+      "Got %s, expected %s.",
+      ltype_name(a->cell[0]->type), ltype_name(LVAL_STR));
+
+   lfile f;
+   LASSERT(a, lfile_open(&f, a->cell[0]->str),
+      "Function 'deserialize' could not open '%s'.", a->cell[0]->str);
+
+   ldec d = { f.data, f.data + f.len };
+   lval *x = lval_qexpr();
+   while (d.p < d.end) {
+      long at = d.p - f.data;
+      lval *v = lval_decode(&d);
+      if (!v) {
+         lval_del(x);
+         x = lval_err_in(lval_ref(a),
+            "Function 'deserialize' found malformed data "
+            "in '%s' at byte %li.", a->cell[0]->str, at);
+         break;
+      }
+      x = lval_add(x, lintern_value(v));
+   }
+
+   lfile_close(&f);
+   lval_del(a);
+   return x;
+}
+
+// reads source text one complete form at a time, the buffer grows to
+// the largest form seen and is reused for the next one
+typedef struct {
+   FILE *f;
+   char *buf;
+   size_t len;
+   size_t cap;
+} lreader;
+
+void lreader_push(lreader *r, int c) {
+   if (r->len + 1 >= r->cap) {
+      r->cap = r->cap ? r->cap * 2 : 256;
+      r->buf = realloc(r->buf, r->cap);
+   }
+   r->buf[r->len++] = c;
+   r->buf[r->len] = '\0';
+}
+
+// read the next form into r->buf, false once the input is exhausted.
+// with lines set a form is every line up to one where all brackets
+// are balanced, otherwise it is a single top level expression.
+bool lreader_next(lreader *r, bool lines, char *prompt) {
+   int depth = 0;
+   bool string = false, escape = false, comment = false, atom = false;
+   r->len = 0;
+   if (r->buf)
+      r->buf[0] = '\0';
+
+   if (prompt) {
+      fputs(prompt, stdout);
+      fflush(stdout);
+   }
+
+   int c;
+   while ((c = fgetc(r->f)) != EOF) {
+      if (comment) {
+         if (c != '\n')
+            continue;
+         comment = false;
+      } else if (string) {
+         lreader_push(r, c);
+         if (escape)
+            escape = false;
+         else if (c == '\\')
+            escape = true;
+         else if (c == '"')
+            string = false;
+         continue;
+      }
+
+      if (c == ';') {
+         comment = true;
+         continue;
+      }
+
+      bool space = isspace(c);
+      bool open = c == '(' || c == '{';
+      bool close = c == ')' || c == '}';
+
+      // an atom at the top level ends at the first delimiter
+      if (!lines && depth == 0 && atom && (space || open || close)) {
+         ungetc(c, r->f);
+         return true;
+      }
+
+      if (c == '\n' && lines) {
+         if (depth <= 0 && !string)
+            return true;
+         if (prompt) {
+            fputs(".. ", stdout);
+            fflush(stdout);
+         }
+      }
+
+      if (space && r->len == 0)
+         continue;
+      lreader_push(r, c);
+
+      if (c == '"') string = true;
+      if (open) depth++;
+      if (close) depth--;
+      if (!space && !open && !close && depth == 0) atom = true;
+
+      if (!lines && close && depth <= 0)
+         return true;
+   }
+
+   // whatever is left at the end of input is the last form
+   return r->len > 0;
+}
+
+// parse src and evaluate its forms one by one, printing each result
+// like load does
+void lrun(lenv *e, char *name, char *src) {
+   mpc_result_t res;
+   if (mpc_parse(name, src, Lispy, &res)) {
+      lval *expr = lval_read(res.output);
+      mpc_ast_delete(res.output);
+      while (expr->count) {
+         llimit_start();
+         lval *x = lval_eval(e, lval_fold(e, lval_pop(expr, 0)));
+         lval_println(x);
+         lval_del(x);
+      }
+      lval_del(expr);
+   } else {
+      mpc_err_print(res.error);
+      mpc_err_delete(res.error);
+   }
+}
+
+// wall time a request may take unless --max-time gives another, in ms
+#define LSERVE_TIME 10000
+
+// requests of one connection, in order. each is evaluated in a child
+// process so that nothing it defines outlives it, the response is what
+// it printed followed by a NUL byte
+void lserve_conn(lenv *e, int fd) {
+   FILE *in = fdopen(fd, "r");
+   dup2(fd, STDOUT_FILENO);
+   lreader r = { in, NULL, 0, 0 };
+
+   while (lreader_next(&r, false, NULL)) {
+      pid_t pid = fork();
+      if (pid == 0) {
+         // the time limit is only checked as the request evaluates, one
+         // that waits on a timer or a command is killed instead
+         alarm(llimit.max_time / 1000 * 2 + 1);
+         lrun(e, "<request>", r.buf);
+         fflush(stdout);
+         _exit(0);
+      }
+
+      int status;
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+         puts("Error: Request failed.");
+      putchar('\0');
+      fflush(stdout);
+   }
+
+   free(r.buf);
+   fclose(in);
+}
+
+// answer requests on a Unix socket at path until killed. a request is
+// one form of source text and a client may send several before reading
+// the responses. every connection gets a child process forked from the
+// warm environment, which it shares copy on write
+bool lserve(lenv *e, char *path) {
+   struct sockaddr_un addr = { .sun_family = AF_UNIX };
+   if (strlen(path) >= sizeof(addr.sun_path))
+      return false;
+   strcpy(addr.sun_path, path);
+
+   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   unlink(path);
+   if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+      || listen(fd, SOMAXCONN) != 0)
+      return false;
+
+   // requests come from clients, none may run for good
+   if (!llimit.max_time) {
+      llimit.max_time = LSERVE_TIME;
+      llimit.active = true;
+   }
+
+   // connections are reaped by the kernel
+   signal(SIGCHLD, SIG_IGN);
+   fflush(stdout);
+   for (;;) {
+      int c = accept(fd, NULL, NULL);
+      if (c < 0) {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+         return false;
+      }
+      if (fork() == 0) {
+         close(fd);
+         signal(SIGCHLD, SIG_DFL);
+         lserve_conn(e, c);
+         _exit(0);
+      }
+      close(c);
+   }
+}
+
+// start tracing into a ring of at least n events
+void ltrace_start(char *path, long n) {
+   uint64_t size = 1;
+   while (size < (uint64_t)n)
+      size <<= 1;
+   ltrace.ring = calloc(size, sizeof(ltrace_event));
+   ltrace.mask = size - 1;
+   ltrace.path = path;
+   ltrace.pid = getpid();
+   ltrace.start = ltrace_clock();
+   ltrace.start_ms = lclock_ms();
+   ltrace.heap_mark = lstats.bytes + LTRACE_HEAP_STEP;
+   ltrace.on = true;
+}
+
+void ltrace_put(int fd, void *p, size_t n) {
+   while (n > 0) {
+      ssize_t k = write(fd, p, n);
+      if (k <= 0)
+         return;
+      p = (char *)p + k;
+      n -= k;
+   }
+}
+
+void ltrace_put_name(int fd, uint64_t what, char *name) {
+   ltrace_name n = { what, strlen(name) };
+   ltrace_put(fd, &n, sizeof(n));
+   ltrace_put(fd, name, n.len);
+}
+
+// write the ring to the trace file, followed by the names of every
+// builtin, of the lambdas bound in the global environment and of the
+// error templates in the events. a forked process, like a request of
+// --serve, writes FILE.pid instead. nothing is allocated, as a crash
+// may get here
+void ltrace_write(void) {
+   if (!ltrace.on)
+      return;
+   ltrace.on = false;
+
+   char path[4096];
+   if (getpid() == ltrace.pid)
+      snprintf(path, sizeof(path), "%s", ltrace.path);
+   else
+      snprintf(path, sizeof(path), "%s.%ld", ltrace.path, (long)getpid());
+   int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (fd < 0)
+      return;
+
+   // ticks are converted by how many went by in a stretch of wall
+   // time, which has to be a few ms long to be accurate
+   while (lclock_ms() - ltrace.start_ms < 5)
+      ;
+   uint64_t ticks = ltrace_clock();
+   double ms = lclock_ms();
+
+   uint64_t size = ltrace.mask + 1;
+   uint64_t count = ltrace.next < size ? ltrace.next : size;
+   uint64_t first = ltrace.next - count;
+   ltrace_header h;
+   memcpy(h.magic, LTRACE_MAGIC, sizeof(h.magic));
+   h.count = count;
+   h.lost = first;
+   h.main = (uintptr_t)&lsched.main;
+   h.ticks_per_ms = (ticks - ltrace.start) / (ms - ltrace.start_ms);
+   ltrace_put(fd, &h, sizeof(h));
+
+   // the ring wraps around once it is full
+   uint64_t at = first & ltrace.mask;
+   uint64_t n = count < size - at ? count : size - at;
+   ltrace_put(fd, &ltrace.ring[at], n * sizeof(ltrace_event));
+   ltrace_put(fd, ltrace.ring, (count - n) * sizeof(ltrace_event));
+
+   for (int i = 0; i < LBUILTIN_COUNT; i++)
+      ltrace_put_name(fd, (uintptr_t)lbuiltins[i].func, lbuiltins[i].name);
+
+   lenv *e = ltrace.env;
+   while (e && e->par)
+      e = e->par;
+   for (int i = 0; e && i < e->count; i++) {
+      lval *f = e->vals[i];
+      if (f->type == LVAL_FUN && !f->builtin && !f->partial)
+         ltrace_put_name(fd, (uintptr_t)f->body, e->syms[i]);
+   }
+
+   // templates are few, each is named once
+   uint64_t seen[256];
+   int nseen = 0;
+   for (uint64_t i = first; i < ltrace.next; i++) {
+      ltrace_event *ev = &ltrace.ring[i & ltrace.mask];
+      if (ev->kind != LTRACE_ERROR)
+         continue;
+      int j = 0;
+      while (j < nseen && seen[j] != ev->what)
+         j++;
+      if (j < nseen)
+         continue;
+      if (nseen < 256)
+         seen[nseen++] = ev->what;
+      ltrace_put_name(fd, ev->what, (char *)(uintptr_t)ev->what);
+   }
+   close(fd);
+}
+
+// write the trace when the program is killed or crashes, then die of
+// the signal as it would have
+void ltrace_signal(int sig) {
+   ltrace_write();
+   raise(sig);
+}
+
+void ltrace_on_signals() {
+   // a stack of its own, for a crash that overflowed the stack
+   static char stack[64 << 10];
+   stack_t ss = { .ss_sp = stack, .ss_size = sizeof(stack) };
+   sigaltstack(&ss, NULL);
+
+   int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGINT, SIGTERM };
+   struct sigaction sa;
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = ltrace_signal;
+   sa.sa_flags = SA_ONSTACK | SA_RESETHAND;
+   sigemptyset(&sa.sa_mask);
+   for (int i = 0; i < (int)(sizeof(sigs) / sizeof(sigs[0])); i++)
+      sigaction(sigs[i], &sa, NULL);
+}
+
+void lstats_report(void) {
+   lstats_print(stderr);
+   if (ljit_state.on)
+      fprintf(stderr, "jit: %ld lambdas compiled, %ld deoptimizations\n",
+         ljit_state.compiled, ljit_state.deopts);
+   if (lcache.hits)
+      fprintf(stderr, "load: %ld files parsed, %ld from the cache\n",
+         lcache.parses, lcache.hits);
+   if (lsched.spawned)
+      fprintf(stderr, "tasks: %ld spawned, %ld switches\n",
+         lsched.spawned, lsched.switches);
+}
+
+// value of a limit option, a positive number
+bool llimit_arg(char *s, double *x) {
+   char *end;
+   *x = strtod(s, &end);
+   return *s && !*end && *x > 0;
+}
+
 int main(int argc, char *argv[]) {
+   // options start with "--", anything else is a file to load
+   char *files[argc];
+   int nfiles = 0;
+   bool batch = false;
+   char *image = NULL;
+   char *save_image = NULL;
+   char *compile_c = NULL;
+   char *serve = NULL;
+   char *trace = NULL;
+   long trace_size = 1 << 16;
+   ljit_stack(&argc);
+   for (int i = 1; i < argc; i++) {
+      bool has_value = i + 1 < argc;
+      if (strcmp(argv[i], "--batch") == 0) {
+         batch = true;
+      } else if (strcmp(argv[i], "--image") == 0 && has_value) {
+         image = argv[++i];
+      } else if (strcmp(argv[i], "--save-image") == 0 && has_value) {
+         save_image = argv[++i];
+      } else if (strcmp(argv[i], "--compile-c") == 0 && has_value) {
+         compile_c = argv[++i];
+      } else if (strcmp(argv[i], "--serve") == 0 && has_value) {
+         serve = argv[++i];
+      } else if (strcmp(argv[i], "--load-cache") == 0 && has_value) {
+         lcache.dir = argv[++i];
+         mkdir(lcache.dir, 0777);
+      } else if (strcmp(argv[i], "--trace") == 0 && has_value) {
+         trace = argv[++i];
+      } else if (strcmp(argv[i], "--trace-size") == 0 && has_value) {
+         double x;
+         if (!llimit_arg(argv[++i], &x)) {
+            fprintf(stderr, "Invalid size %s for %s\n", argv[i], argv[i-1]);
+            return 1;
+         }
+         trace_size = x;
+      } else if (strcmp(argv[i], "--allow-run") == 0) {
+         lrun_allowed = true;
+      } else if (strcmp(argv[i], "--intern") == 0) {
+         lintern.on = true;
+      } else if (strcmp(argv[i], "--reference") == 0) {
+         lreference = true;
+      } else if (strcmp(argv[i], "--jit") == 0) {
+#ifdef LJIT_NATIVE
+         ljit_state.on = true;
+#else
+         fprintf(stderr, "--jit needs x86-64 Linux, ignored\n");
+#endif
+      } else if (strcmp(argv[i], "--stats") == 0) {
+         lstats.timed = true;
+         atexit(lstats_report);
+      } else if (strncmp(argv[i], "--max-", 6) == 0 && has_value) {
+         double x;
+         char *opt = argv[i] + 6;
+         if (!llimit_arg(argv[++i], &x)) {
+            fprintf(stderr, "Invalid limit %s for %s\n", argv[i], argv[i-1]);
+            return 1;
+         }
+         if (strcmp(opt, "steps") == 0)
+            llimit.max_steps = x;
+         else if (strcmp(opt, "depth") == 0)
+            llimit.max_depth = x;
+         else if (strcmp(opt, "heap") == 0)
+            llimit.max_heap = x * 1024;
+         else if (strcmp(opt, "time") == 0)
+            llimit.max_time = x;
+         else {
+            fprintf(stderr, "Unknown option %s\n", argv[i-1]);
+            return 1;
+         }
+         llimit.active = true;
+      } else if (strncmp(argv[i], "--", 2) == 0) {
+         fprintf(stderr, "Unknown option %s\n", argv[i]);
+         return 1;
+      } else {
+         files[nfiles++] = argv[i];
+      }
+   }
+
    Number = mpc_new("number");
    Symbol = mpc_new("symbol");
    String = mpc_new("string");
@@ -1339,43 +5876,82 @@ int main(int argc, char *argv[]) {
     ",
     Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
   
+   if (compile_c) {
+      bool ok = lcompile_c(compile_c, stdout);
+      mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+      return ok ? 0 : 1;
+   }
+
    lenv *e = lenv_new();
-   lenv_add_builtins(e);
-   if (argc == 1) {
+   if (trace) {
+      ltrace_start(trace, trace_size);
+      ltrace.env = e;
+      ltrace_on_signals();
+      atexit(ltrace_write);
+   }
+   if (!image) {
+      lenv_add_builtins(e);
+   } else if (!limage_load(e, image)) {
+      fprintf(stderr, "Could not load image %s\n", image);
+      return 1;
+   }
+   lreader r = { stdin, NULL, 0, 0 };
+
+   // files come first, so --batch can use what they define
+   for (int i = 0; i < nfiles; i++) {
+      lval *args = lval_add(lval_sexpr(), lval_str(files[i]));
+      llimit_start();
+      lval *x = builtin_load(e, args);
+      if (x->type == LVAL_ERR)
+         lval_println(x);
+      lval_del(x);
+   }
+
+   if (batch) {
+      // evaluate stdin form by form, like a file passed to load
+      while (lreader_next(&r, false, NULL))
+         lrun(e, "<stdin>", r.buf);
+   } else if (nfiles == 0 && !save_image && !serve) {
       puts("Press Ctrl+C to Exit\n");
 
-      // load standard library
-      lval *a = lval_add(lval_sexpr(), lval_str("prelude.lspy"));
-      lval *x = builtin_load(e, a); 
-      lval_del(x);
-      while (true) {
-         fputs("> ", stdout);
-         fgets(input, BUFFER_SIZE, stdin);
-
-         mpc_result_t r;
-         if (mpc_parse("<stdin>", input, Lispy, &r)) {
-            lval *res = lval_eval(e, lval_read(r.output));
-            lval_println(res);
-            lval_del(res);
-            mpc_ast_delete(r.output);
+      // load standard library, an image already has it
+      if (!image) {
+         lval *a = lval_add(lval_sexpr(), lval_str("prelude.lspy"));
+         llimit_start();
+         lval *x = builtin_load(e, a); 
+         lval_del(x);
+      }
+      while (lreader_next(&r, true, "> ")) {
+         mpc_result_t res;
+         if (mpc_parse("<stdin>", r.buf, Lispy, &res)) {
+            llimit_start();
+            lval *v = lval_eval(e, lval_fold(e, lval_read(res.output)));
+            lval_println(v);
+            lval_del(v);
+            mpc_ast_delete(res.output);
          } else {
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            mpc_err_print(res.error);
+            mpc_err_delete(res.error);
          }
       }
+      putchar('\n');
    }
+   free(r.buf);
    
-   if (argc >= 2) {
-      for (int i = 1; i < argc; i++) {
-         lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
-         lval *x = builtin_load(e, args);
-         if (x->type == LVAL_ERR)
-            lval_println(x);
-         lval_del(x);
-      }
+   int status = 0;
+   if (save_image && !limage_save(e, save_image)) {
+      fprintf(stderr, "Could not save image %s\n", save_image);
+      status = 1;
+   }
+
+   if (serve && !lserve(e, serve)) {
+      fprintf(stderr, "Could not serve on %s\n", serve);
+      status = 1;
    }
 
+   ltrace_write();
    mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+   lcache_clear();
    lenv_del(e);
-   return 0;
+   return status;
 }
@@ -0,0 +1,320 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+// renders a trace written by ./main --trace as a timeline.
+//
+//   trace/dump [-s] [-n events] file
+//
+// prints a line per event with its time in ms since the first one:
+// calls and returns indented by depth, with the time each call took,
+// errors raised, heap growth and task switches. a call that returned
+// before anything else happened takes one line. -n prints only the
+// last n events, -s a summary per function and per error instead
+
+#define MAX_INDENT 32
+
+// the format ltrace_write in main.c writes
+enum {
+   LTRACE_ENTER = 1,
+   LTRACE_EXIT,
+   LTRACE_ERROR,
+   LTRACE_HEAP,
+   LTRACE_TASK,
+};
+
+typedef struct {
+   uint64_t time;
+   uint64_t what;
+   uint32_t kind;
+   uint32_t depth;
+} event;
+
+typedef struct {
+   char magic[8];
+   uint64_t count;
+   uint64_t lost;
+   uint64_t main;
+   double ticks_per_ms;
+} header;
+
+typedef struct {
+   uint64_t what;
+   uint32_t len;
+} name_head;
+
+struct name {
+   uint64_t what;
+   char *name;
+} *names;
+int nnames;
+
+// a call in progress
+typedef struct {
+   uint64_t what;
+   uint64_t time;
+} frame;
+
+// the calls in progress in each task, the main task is the first
+struct task {
+   uint64_t id;
+   frame *stack;
+   int depth;
+   int cap;
+} *tasks;
+int ntasks;
+
+// totals of the summary, per function or error template
+struct total {
+   uint64_t what;
+   uint32_t kind;
+   long count;
+   double ms;      // in calls, counting only the outermost of a recursion
+} *totals;
+int ntotals;
+
+header h;
+event *events;
+
+int cmp_name(const void *a, const void *b) {
+   uint64_t x = ((const struct name *)a)->what;
+   uint64_t y = ((const struct name *)b)->what;
+   return (x > y) - (x < y);
+}
+
+int cmp_total(const void *a, const void *b) {
+   const struct total *x = a, *y = b;
+   if (x->kind != y->kind)
+      return (x->kind > y->kind) - (x->kind < y->kind);
+   if (x->kind == LTRACE_ERROR)
+      return (x->count < y->count) - (x->count > y->count);
+   return (x->ms < y->ms) - (x->ms > y->ms);
+}
+
+// name of a function or error template, lambdas that were not bound in
+// the global environment go by the address of their body
+char *name_of(uint64_t what) {
+   static char buf[32];
+   struct name key = { what, NULL };
+   struct name *n = bsearch(&key, names, nnames, sizeof(*names), cmp_name);
+   if (n)
+      return n->name;
+   snprintf(buf, sizeof(buf), "lambda %#lx", (unsigned long)what);
+   return buf;
+}
+
+double ms_of(uint64_t time) {
+   return (double)(time - events[0].time) / h.ticks_per_ms;
+}
+
+char *duration(double ms) {
+   static char buf[32];
+   if (ms < 1)
+      snprintf(buf, sizeof(buf), "%.1f us", ms * 1000);
+   else
+      snprintf(buf, sizeof(buf), "%.3f ms", ms);
+   return buf;
+}
+
+struct task *task_of(uint64_t id) {
+   for (int i = 0; i < ntasks; i++)
+      if (tasks[i].id == id)
+         return &tasks[i];
+   tasks = realloc(tasks, sizeof(*tasks) * (ntasks + 1));
+   struct task *t = &tasks[ntasks++];
+   t->id = id;
+   t->stack = NULL;
+   t->depth = 0;
+   t->cap = 0;
+   return t;
+}
+
+void push(struct task *t, uint64_t what, uint64_t time) {
+   if (t->depth == t->cap) {
+      t->cap = t->cap ? t->cap * 2 : 64;
+      t->stack = realloc(t->stack, sizeof(frame) * t->cap);
+   }
+   t->stack[t->depth].what = what;
+   t->stack[t->depth].time = time;
+   t->depth++;
+}
+
+bool calling(struct task *t, uint64_t what) {
+   for (int i = 0; i < t->depth; i++)
+      if (t->stack[i].what == what)
+         return true;
+   return false;
+}
+
+void add_total(uint64_t what, uint32_t kind, double ms) {
+   int i = 0;
+   while (i < ntotals && (totals[i].what != what || totals[i].kind != kind))
+      i++;
+   if (i == ntotals) {
+      totals = realloc(totals, sizeof(*totals) * (ntotals + 1));
+      totals[i].what = what;
+      totals[i].kind = kind;
+      totals[i].count = 0;
+      totals[i].ms = 0;
+      ntotals++;
+   }
+   totals[i].count++;
+   totals[i].ms += ms;
+}
+
+bool read_trace(char *path) {
+   FILE *f = fopen(path, "rb");
+   if (!f) {
+      perror(path);
+      return false;
+   }
+   if (fread(&h, sizeof(h), 1, f) != 1
+      || memcmp(h.magic, "LSPYTRC1", sizeof(h.magic)) != 0) {
+      fprintf(stderr, "%s: not a trace\n", path);
+      fclose(f);
+      return false;
+   }
+   events = malloc(sizeof(event) * (h.count ? h.count : 1));
+   if (fread(events, sizeof(event), h.count, f) != h.count) {
+      fprintf(stderr, "%s: trace cut short\n", path);
+      fclose(f);
+      return false;
+   }
+
+   name_head n;
+   while (fread(&n, sizeof(n), 1, f) == 1) {
+      names = realloc(names, sizeof(*names) * (nnames + 1));
+      names[nnames].what = n.what;
+      names[nnames].name = malloc(n.len + 1);
+      if (fread(names[nnames].name, 1, n.len, f) != n.len)
+         break;
+      names[nnames].name[n.len] = '\0';
+      nnames++;
+   }
+   qsort(names, nnames, sizeof(*names), cmp_name);
+   fclose(f);
+   return true;
+}
+
+int main(int argc, char *argv[]) {
+   bool summary = false;
+   long last = -1;
+   int opt;
+   while ((opt = getopt(argc, argv, "sn:")) != -1) {
+      switch (opt) {
+         case 's': summary = true; break;
+         case 'n': last = atol(optarg); break;
+         default: return 2;
+      }
+   }
+   if (argc - optind != 1) {
+      fprintf(stderr, "usage: %s [-s] [-n events] file\n", argv[0]);
+      return 2;
+   }
+   if (!read_trace(argv[optind]))
+      return 1;
+   if (h.count == 0) {
+      printf("no events\n");
+      return 0;
+   }
+
+   printf("%lu events over %s", (unsigned long)h.count,
+      duration(ms_of(events[h.count - 1].time)));
+   if (h.lost)
+      printf(", %lu older ones lost", (unsigned long)h.lost);
+   printf("\n");
+
+   // events before the first switch ran in the main task, as far as
+   // anyone knows when older ones were lost
+   struct task *t = task_of(h.main);
+   uint64_t from = last >= 0 && (uint64_t)last < h.count ? h.count - last : 0;
+   for (uint64_t i = 0; i < h.count; i++) {
+      event *ev = &events[i];
+      bool show = !summary && i >= from;
+      // deep recursion is indented up to a point, then numbered
+      if (show && ev->depth <= MAX_INDENT)
+         printf("%12.3f  %*s", ms_of(ev->time), 2 * (int)ev->depth, "");
+      else if (show)
+         printf("%12.3f  %*s[%u] ", ms_of(ev->time), 2 * MAX_INDENT, "",
+            ev->depth);
+
+      switch (ev->kind) {
+         case LTRACE_ENTER:
+            // returned before anything else happened
+            if (i + 1 < h.count && events[i + 1].kind == LTRACE_EXIT
+               && events[i + 1].what == ev->what) {
+               double ms = ms_of(events[i + 1].time) - ms_of(ev->time);
+               if (show)
+                  printf("%s  %s\n", name_of(ev->what), duration(ms));
+               add_total(ev->what, LTRACE_ENTER,
+                  calling(t, ev->what) ? 0 : ms);
+               i++;
+               break;
+            }
+            if (show)
+               printf("-> %s\n", name_of(ev->what));
+            push(t, ev->what, ev->time);
+            break;
+
+         case LTRACE_EXIT:
+            // its call may be older than the oldest event
+            if (t->depth && t->stack[t->depth - 1].what == ev->what) {
+               t->depth--;
+               double ms = ms_of(ev->time) - ms_of(t->stack[t->depth].time);
+               if (show)
+                  printf("<- %s  %s\n", name_of(ev->what), duration(ms));
+               add_total(ev->what, LTRACE_ENTER,
+                  calling(t, ev->what) ? 0 : ms);
+            } else if (show) {
+               printf("<- %s\n", name_of(ev->what));
+            }
+            break;
+
+         case LTRACE_ERROR:
+            if (show)
+               printf("error: %s\n", name_of(ev->what));
+            add_total(ev->what, LTRACE_ERROR, 0);
+            break;
+
+         case LTRACE_HEAP:
+            if (show)
+               printf("heap: %.1f MB\n", ev->what / 1048576.0);
+            break;
+
+         case LTRACE_TASK:
+            t = task_of(ev->what);
+            if (show) {
+               if (t == tasks)
+                  printf("task: main\n");
+               else
+                  printf("task: %d\n", (int)(t - tasks));
+            }
+            break;
+
+         default:
+            if (show)
+               printf("unknown event %u\n", ev->kind);
+            break;
+      }
+   }
+
+   if (summary) {
+      qsort(totals, ntotals, sizeof(*totals), cmp_total);
+      printf("%-24s %10s %14s %12s\n", "function", "calls", "total", "per call");
+      for (int i = 0; i < ntotals; i++) {
+         struct total *x = &totals[i];
+         if (x->kind == LTRACE_ERROR) {
+            printf("%6ld errors: %s\n", x->count, name_of(x->what));
+            continue;
+         }
+         printf("%-24s %10ld %14s", name_of(x->what), x->count,
+            duration(x->ms));
+         printf(" %12s\n", duration(x->ms / x->count));
+      }
+   }
+   return 0;
+}